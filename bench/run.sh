@@ -0,0 +1,105 @@
+#!/bin/sh
+# Replay a few fixed input corpora through lemonbar on a private Xvfb and report, for each one,
+# the input lines per second and the cost of every frame that was actually drawn.
+#
+# usage: bench/run.sh path/to/lemonbar-bench [lines]
+#
+# The binary must be built with -DBENCH (make bench does that), it then draws every line it reads
+# and reports the frames drawn, the requests and bytes sent to the server and the CPU time used
+# when it exits. A run drawing fewer frames than lines is an error.
+
+BAR=${1:?usage: $0 path/to/lemonbar-bench [lines]}
+LINES=${2:-2000}
+DPY=${BENCH_DISPLAY:-:99}
+FONT=${BENCH_FONT:-fixed}
+
+command -v Xvfb >/dev/null || { echo "Xvfb is needed to run the benchmarks" >&2; exit 1; }
+
+TMP=$(mktemp -d)
+XVFB=
+trap 'test -n "$XVFB" && kill $XVFB 2>/dev/null; rm -rf "$TMP"' EXIT
+trap 'exit 1' INT TERM
+
+Xvfb "$DPY" -screen 0 1920x1080x24 -nolisten tcp >"$TMP/xvfb.log" 2>&1 &
+XVFB=$!
+
+# Wait for the server socket to show up
+n=0
+while [ ! -S "/tmp/.X11-unix/X${DPY#:}" ]; do
+    n=$((n + 1))
+    if [ $n -gt 100 ] || ! kill -0 $XVFB 2>/dev/null; then
+        echo "Xvfb didn't start:" >&2
+        cat "$TMP/xvfb.log" >&2
+        exit 1
+    fi
+    sleep 0.05
+done
+
+# Every corpus changes a bit from line to line, otherwise there'd be nothing to redraw
+corpus () {
+    awk -v lines="$LINES" -v kind="$1" 'BEGIN {
+        for (i = 0; i < lines; i++) {
+            s = i % 60; m = int(i / 60) % 60
+            if (kind == "ascii") {
+                printf "workspace 1 2 3 4 5 | some window title number %d | cpu %d%% mem %d%% | 12:%02d:%02d\n", i, i % 100, (i * 7) % 100, m, s
+            } else if (kind == "colors") {
+                line = ""
+                for (j = 0; j < 40; j++)
+                    line = line sprintf("%%{F#ff%02x%02x%02x}%%{B#ff%02x%02x%02x} %d ", (i + j) % 256, (j * 5) % 256, (i * 3) % 256, (j * 7) % 256, i % 256, (i + j * 11) % 256, j)
+                print line "%{F-}%{B-}"
+            } else if (kind == "align") {
+                printf "%%{l} left %d %%{c} center %d of the bar %%{r} right 12:%02d:%02d \n", i, i * 3, m, s
+            } else if (kind == "areas") {
+                line = ""
+                for (j = 0; j < 30; j++)
+                    line = line sprintf("%%{A:cmd %d %d:}%%{A3:other %d:} [%d] %%{A}%%{A}", i, j, j, (i + j) % 10)
+                print line
+            } else if (kind == "monitors") {
+                printf "%%{Sf}%%{l}first %d%%{r}12:%02d%%{S+}%%{c}second %d%%{Sl}%%{r}last %d\n", i, m, s, i, i * 2
+            } else if (kind == "long") {
+                line = ""
+                for (j = 0; j < 60; j++)
+                    line = line sprintf("item%d-%d ", j, (i + j) % 1000)
+                print line
+            }
+        }
+    }' > "$TMP/$1"
+}
+
+now_ns () {
+    date +%s%N
+}
+
+printf "%-10s %8s %8s %12s %12s %12s %12s\n" corpus lines/s frames "us cpu/fr" "requests/fr" "bytes/fr" "lines"
+
+for kind in ascii colors align areas monitors long; do
+    corpus $kind
+
+    start=$(now_ns)
+    DISPLAY=$DPY "$BAR" -f "$FONT" -g x20 < "$TMP/$kind" 2> "$TMP/$kind.err" > /dev/null
+    end=$(now_ns)
+
+    stats=$(grep '^bench ' "$TMP/$kind.err")
+    if [ -z "$stats" ]; then
+        echo "$kind: no figures reported, is $BAR built with -DBENCH?" >&2
+        cat "$TMP/$kind.err" >&2
+        exit 1
+    fi
+
+    frames=$(echo "$stats" | sed -n 's/.* frames=\([0-9]*\).*/\1/p')
+    if [ "$frames" != "$LINES" ]; then
+        echo "$kind: $frames frames drawn for $LINES lines" >&2
+        cat "$TMP/$kind.err" >&2
+        exit 1
+    fi
+
+    echo "$stats" | awk -v kind=$kind -v lines="$LINES" -v ns=$((end - start)) '{
+        for (i = 2; i <= NF; i++) {
+            split($i, kv, "=")
+            v[kv[1]] = kv[2]
+        }
+        f = v["frames"] ? v["frames"] : 1
+        printf "%-10s %8d %8d %12.1f %12.1f %12.1f %12d\n", kind, lines / (ns / 1e9), v["frames"],
+            v["cpu_us"] / f, v["requests"] / f, v["bytes"] / f, lines
+    }'
+done
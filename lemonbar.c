@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <ctype.h>
 #include <signal.h>
 #include <poll.h>
@@ -12,14 +13,37 @@
 #include <getopt.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#ifdef BENCH
+#include <sys/resource.h>
+#endif
 #include <xcb/xcb.h>
 #include <xcb/xcbext.h>
 #if WITH_XINERAMA
 #include <xcb/xinerama.h>
 #endif
 #include <xcb/randr.h>
+#if WITH_SHM
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <xcb/shm.h>
+#endif
+#if WITH_PRESENT
+#include <xcb/present.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <X11/Xft/Xft.h>
+#include <X11/extensions/Xrender.h>
 #include <X11/Xlib-xcb.h>
 
 // Here bet  dragons
@@ -28,23 +52,130 @@
 #define min(a,b) ((a) < (b) ? (a) : (b))
 #define indexof(c,s) (strchr((s),(c))-(s))
 
+// The input is read in chunks of this size
+#define READ_CHUNK 4096
+// Producers connected to the control socket at the same time
+#define MAX_CLIENTS 32
+// Built-in producers, see -t
+#define MAX_SOURCES 8
+// Clicks waiting for the consumer of the standard output
+#define MAX_QUEUED_CLICKS 64
+// Named regions, a region is never forgotten once created
+#define MAX_REGIONS 64
+// Longest line a producer can send on the control socket
+#define MAX_CLIENT_LINE 65536
+
+// The maximum number of glyphs drawn with a single request
+#define MAX_RUN_LEN 1024
+// A PolyText16 item can hold up to 254 glyphs
+#define TEXT_ITEM_MAX 254
+#define MAX_TEXT_ITEMS ((MAX_RUN_LEN + TEXT_ITEM_MAX - 1) / TEXT_ITEM_MAX)
+
+// The advance of the glyphs in this range is looked up from a flat table
+#define DENSE_WIDTHS 256
+
+// Open addressing hash table indexed by codepoint, the zero codepoint marks an empty slot
+typedef struct cp_entry_t {
+    uint32_t cp;
+    int val;
+} cp_entry_t;
+
+typedef struct cp_map_t {
+    cp_entry_t *slot;
+    int size, used;
+} cp_map_t;
+
 typedef struct font_t {
     xcb_font_t ptr;
     xcb_charinfo_t *width_lut;
 
     XftFont *xft_ft;
+    // Glyph advances, the dense table is filled when the font is loaded
+    int16_t dense_width[DENSE_WIDTHS];
+    cp_map_t width_map;
 
     int ascent;
 
     int descent, height, width;
     uint16_t char_max;
     uint16_t char_min;
+
+    // Set until the font is actually loaded, the core font requests are sent right away and
+    // their replies collected the first time the font is needed
+    char *pattern;
+    xcb_void_cookie_t open_cookie;
+    xcb_query_font_cookie_t query_cookie;
+
+#if WITH_SHM
+    // The glyphs rasterized so far, indexed by codepoint
+    struct shm_glyph_t *shm_glyph;
+    int shm_glyphs, shm_max_glyphs;
+    cp_map_t shm_map;
+    // The FreeType flags matching the way Xft renders the font, filled the first time it's drawn.
+    // The fonts rendered with subpixel antialiasing are left to the server.
+    bool shm_setup, shm_server;
+    FT_Int32 shm_load_flags;
+#endif
 } font_t;
 
+#if WITH_SHM
+// A glyph bitmap as rendered by FreeType, one coverage byte per pixel
+typedef struct shm_glyph_t {
+    int left, top;
+    int width, height;
+    uint8_t *bits;
+    // A color bitmap, the runs holding one are left to the server
+    bool color;
+} shm_glyph_t;
+#endif
+
+// The number of mouse buttons an area can be bound to
+#define AREA_BUTTONS 5
+
+// The clickable areas of a monitor flattened into segments that don't overlap, for every segment
+// and button the innermost area covering it is stored (or -1)
+typedef struct area_index_t {
+    int *edge;
+    int *hit;
+    int count;
+    int max_edge, max_hit;
+} area_index_t;
+
 typedef struct monitor_t {
     int x, y, width;
     xcb_window_t window;
     xcb_pixmap_t pixmap;
+    Picture picture;
+    // The regions of the pixmap that have been redrawn and not copied onto the window yet, sorted
+    // and not overlapping
+    xcb_rectangle_t *damage;
+    int damage_count, damage_max;
+    area_index_t areas;
+    bool mapped;
+#if WITH_SHM
+    // The bar is rendered in this buffer and pushed to the pixmap, if it could be set up
+    uint32_t *shm_data;
+    xcb_shm_seg_t shm_seg;
+    // Set until the server is done reading the buffer
+    bool shm_busy;
+#endif
+#if WITH_PRESENT
+    // The frames are drawn in turn on two pixmaps presented on the window at the vertical
+    // blank, pixmap is the one presented last. Set if Present is used for this monitor.
+    xcb_pixmap_t buffer[2];
+    Picture buffer_picture[2];
+    // The one the next frame is drawn on, and whether the server is done reading each one
+    int back;
+    bool buffer_idle[2];
+    // Set from the moment a frame is presented until it's on screen, or until present_at is too
+    // old to wait any longer
+    bool present_busy;
+    int64_t present_at;
+    uint32_t present_serial;
+    // What the last frame changed, the other pixmap doesn't have it yet
+    xcb_rectangle_t *present_last;
+    int present_last_count, present_last_max;
+#endif
     struct monitor_t *prev, *next;
 } monitor_t;
 
@@ -52,10 +183,10 @@ typedef struct area_t {
     unsigned int begin:16;
     unsigned int end:16;
     bool active:1;
-    int align:3;
     unsigned int button:3;
-    xcb_window_t window;
-    char *cmd;
+    int block;
+    // Offset of the command in the string pool
+    int cmd;
 } area_t;
 
 typedef union rgba_t {
@@ -68,9 +199,106 @@ typedef union rgba_t {
     uint32_t v;
 } rgba_t;
 
+// A slice of a monitor holding the content that shares the same alignment
+typedef struct block_t {
+    monitor_t *mon;
+    int align;
+    int x, width;
+} block_t;
+
+// A run of glyphs sharing the same font and style, drawn with a single request. Runs without a
+// font are just blank space (see the O command). The position is relative to the block start.
+typedef struct run_t {
+    int block;
+    int x, width;
+    font_t *font;
+    int offset_y;
+    uint32_t attrs;
+    // The background is a gradient if bg_stop differs from bg
+    rgba_t fg, bg, bg_stop, ug;
+    int glyph, len;
+    // Set if the run has to be redrawn, or in the previous frame if its area has to be cleared
+    bool dirty;
+} run_t;
+
+// The parsed line, it's measured first and then drawn in one go
+typedef struct frame_t {
+    rgba_t clear;
+    block_t *block;
+    int blocks, max_blocks;
+    run_t *run;
+    int runs, max_runs;
+    uint32_t *glyph;
+    int glyphs, max_glyphs;
+} frame_t;
+
+// The input is read in a growable buffer and the lines are parsed in place. The newest complete
+// line is kept in the buffer until a newer one replaces it.
+typedef struct reader_t {
+    char *buf;
+    int len, cap;
+    // Start of the line being received, start and end of the newest complete line
+    int head, line, line_end;
+    // The input is treated as over when a line grows past this size, zero for no limit
+    int max_line;
+    bool eof;
+} reader_t;
+
+// A part of the bar that can be updated on its own with a "@name text" line. The standard input
+// line places the regions with %{N:name}...%{N}, the ones it doesn't place aren't drawn.
+typedef struct region_t {
+    char *name;
+    char *text;
+    // The first piece of the document drawing the region, or -1
+    int piece;
+} region_t;
+
+// Where the parser stands, saved at the start of every region so that the document can be parsed
+// again from there when nothing before it changed
+typedef struct parse_state_t {
+    monitor_t *mon;
+    int block, align;
+    // What the frame and the area stack hold at this point
+    int blocks, runs, glyphs, block_width;
+    int areas, area_str;
+    // An area is open, closing it again would need the part of the line before this point
+    bool area_open;
+    rgba_t fg, bg, bg_stop, ug;
+    uint32_t attrs;
+    int font_index, offset_y_index;
+} parse_state_t;
+
+// The document is the standard input line cut at the regions it places. The text and the name
+// are offsets in the line, which stays in the reader buffer and may be moved around there.
+typedef struct piece_t {
+    int text;
+    // The region drawn in place of the text, the pieces of the line only know its name
+    int name;
+    int region;
+    parse_state_t state;
+} piece_t;
+
+typedef struct client_t {
+    int fd;
+    reader_t reader;
+} client_t;
+
+// A built-in producer filling a region every interval seconds
+typedef struct source_t {
+    int kind;
+    int fd;
+    int interval;
+    char *name;
+    char *arg;
+} source_t;
+
 typedef struct area_stack_t {
     int at, max;
+    // The areas below this one were opened outside the region being parsed, it can't close them
+    int floor;
     area_t *area;
+    char *str;
+    int str_len, str_max;
 } area_stack_t;
 
 enum {
@@ -105,10 +333,23 @@ static xcb_colormap_t colormap;
 
 
 static monitor_t *monhead, *montail;
+// Monitors of the previous layout while it's being rebuilt, monitor_new takes them back
+static monitor_t *monspare;
+// Where the blocks following %{S*} are drawn, they're then copied on every monitor. It's as wide
+// as the widest monitor and only set up when first needed.
+static monitor_t mirror;
+// Base of the RandR event codes, zero if the screen changes aren't being tracked
+static uint8_t randr_base;
 static font_t *font_list[MAX_FONT_COUNT];
 static int font_count = 0;
 static int font_index = -1;
 static int offsets_y[MAX_FONT_COUNT];
+// Bitmask of the fonts able to draw each codepoint, the low byte tells which fonts have the glyph
+// and the high one which fonts have been asked. Fonts are only asked when the ones before them
+// can't draw the codepoint so that the fallbacks are loaded the first time they're needed.
+#define COVERAGE_KNOWN(i) (0x100 << (i))
+static uint16_t dense_coverage[DENSE_WIDTHS];
+static cp_map_t coverage_map;
 static int offset_y_count = 0;
 static int offset_y_index = 0;
 
@@ -118,58 +359,243 @@ static bool topbar = true;
 static int bw = -1, bh = -1, bx = 0, by = 0;
 static int bu = 1; // Underline height
 static rgba_t fgc, bgc, ugc;
+static rgba_t bgc_stop; // Bottom color of the background gradient, same as bgc if there's none
 static rgba_t dfgc, dbgc, dugc;
 static area_stack_t area_stack;
+static frame_t frame, last_frame;
+static bool full_redraw = true;
+
+// The pictures the text and the gradients are painted with are created once and kept around, the
+// cache is flushed if it grows past this size
+#define MAX_COLOR_CACHE 256
+typedef struct color_t {
+    rgba_t rgba, stop;
+    Picture fill;
+} color_t;
+
+// The foreground currently set in each gc and the font set in the drawing one
+static rgba_t gc_color[GC_MAX];
+static xcb_font_t gc_font;
+static color_t *color_cache;
+static int color_count, color_max;
+static XRenderPictFormat *pict_format;
+
+// Time figures are kept as histograms, bucket i counts the samples below 2^(i+1) microseconds and
+// the last one everything else
+#define HIST_BUCKETS 16
+typedef struct histogram_t {
+    uint32_t bucket[HIST_BUCKETS];
+    uint64_t count, total;
+} histogram_t;
+
+// Runtime counters, dumped on SIGUSR1 and periodically to the file given with -S
+#define STATS_INTERVAL 5000
+static struct {
+    uint64_t lines, frames;
+    // The standard input lines a newer one replaced before they were drawn
+    uint64_t skipped;
+    uint64_t runs, glyphs;
+    uint64_t width_hits, width_misses;
+    uint64_t gc_changes, gc_skips;
+    uint64_t fill_hits, fill_misses;
+    uint64_t clicks, clicks_dropped;
+    // The NoOperation requests sent to find out the request count
+    uint64_t noops;
+    histogram_t parse_us, draw_us;
+} stats;
+static volatile sig_atomic_t stats_requested;
+
+static int sock_fd = -1;
+static char *sock_path;
+static client_t client[MAX_CLIENTS];
+static region_t *region;
+static int regions, max_regions;
+// The standard input, the newest line to draw is kept in the buffer. It's only cut in place at
+// the regions when it's drawn, the lines superseded in the meantime cost nothing.
+static reader_t input = { .line = -1 };
+static bool input_fresh;
+static piece_t *line_piece;
+static int line_pieces, max_line_pieces;
+static piece_t *piece;
+static int pieces, max_pieces;
+// The document has to be built again, otherwise only the pieces starting from dirty_piece have to
+// be parsed again
+static bool pieces_stale = true;
+static int dirty_piece = INT_MAX;
+static source_t source[MAX_SOURCES];
+static int sources;
+// The commands of the clicks not written yet, newline included. They're written without blocking,
+// a consumer that stalls doesn't stall the bar.
+static struct {
+    char *cmd[MAX_QUEUED_CLICKS];
+    int head, count;
+    // Where the clicks are written, see click_open. Sent with MSG_DONTWAIT if it's a socket.
+    int fd;
+    bool sock;
+    // How much of the oldest command has been written
+    size_t written;
+    // What to do when the queue is full, drop the oldest click or, if the new one is already
+    // queued, just forget it
+    bool coalesce;
+} clickq;
+#if WITH_PRESENT
+// Major opcode of the Present extension, its events come as generic events tagged with it. Zero
+// if the extension isn't used.
+static uint8_t present_opcode;
+// How long to wait for the server to tell that a frame is on screen or that a pixmap is free, in
+// milliseconds. The events don't come when the window is unmapped or hidden.
+#define PRESENT_TIMEOUT 100
+#endif
+#if WITH_SHM
+// Base of the MIT-SHM event codes and depth of the pixmaps, zero if the extension isn't used
+static uint8_t shm_base;
+static uint8_t shm_depth;
+#endif
+
+
+// Monotonic clock in microseconds
+int64_t
+now_us (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Monotonic clock in milliseconds, used to pace the redraws
+int64_t
+now_ms (void)
+{
+    return now_us() / 1000;
+}
+
+void
+histogram_add (histogram_t *h, const int64_t value)
+{
+    int i = 0;
+
+    while (i < HIST_BUCKETS - 1 && value >= 2 << i)
+        i++;
+
+    h->bucket[i]++;
+    h->count++;
+    h->total += value;
+}
 
-static XftColor sel_fg;
-static XftDraw *xft_draw;
+void *
+grow_array (void *ptr, int *max, const int need, const size_t size)
+{
+    if (need <= *max)
+        return ptr;
+
+    const int n = max(max(*max * 2, need), 16);
+    void *tmp = realloc(ptr, n * size);
+    if (!tmp) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
 
-//char width lookuptable
-#define MAX_WIDTHS (1 << 16)
-static wchar_t xft_char[MAX_WIDTHS];
-static char    xft_width[MAX_WIDTHS];
+    *max = n;
+    return tmp;
+}
 
 void
-update_gc (void)
+update_gc (const int i, const rgba_t color)
 {
-    xcb_change_gc(c, gc[GC_DRAW], XCB_GC_FOREGROUND, (const uint32_t []){ fgc.v });
-    xcb_change_gc(c, gc[GC_CLEAR], XCB_GC_FOREGROUND, (const uint32_t []){ bgc.v });
-    xcb_change_gc(c, gc[GC_ATTR], XCB_GC_FOREGROUND, (const uint32_t []){ ugc.v });
-    XftColorFree(dpy, visual_ptr, colormap , &sel_fg);
-    char color[] = "#ffffff";
-    uint32_t nfgc = fgc.v & 0x00ffffff;
-    snprintf(color, sizeof(color), "#%06X", nfgc);
-    if (!XftColorAllocName (dpy, visual_ptr, colormap, color, &sel_fg)) {
-        fprintf(stderr, "Couldn't allocate xft font color '%s'\n", color);
+    // Only talk to the server when the color really changes
+    if (gc_color[i].v == color.v) {
+        stats.gc_skips++;
+        return;
     }
+
+    stats.gc_changes++;
+    gc_color[i] = color;
+    xcb_change_gc(c, gc[i], XCB_GC_FOREGROUND, (const uint32_t []){ color.v });
 }
 
 void
-fill_gradient (xcb_drawable_t d, int x, int y, int width, int height, rgba_t start, rgba_t stop)
+color_cache_flush (void)
+{
+    for (int i = 0; i < color_count; i++)
+        XRenderFreePicture(dpy, color_cache[i].fill);
+    color_count = 0;
+}
+
+rgba_t
+color_lerp (const rgba_t start, const rgba_t stop, const int i, const int n)
+{
+    // Sample the middle of the i-th of n steps
+    const int b = 2 * i + 1, a = 2 * n - b;
+
+    return (rgba_t){
+        .r = (start.r * a + stop.r * b) / (2 * n),
+        .g = (start.g * a + stop.g * b) / (2 * n),
+        .b = (start.b * a + stop.b * b) / (2 * n),
+        .a = (start.a * a + stop.a * b) / (2 * n),
+    };
+}
+
+XRenderColor
+color_straight (const rgba_t rgba)
+{
+    // Undo the premultiplication
+    if (!rgba.a)
+        return (XRenderColor){ 0, 0, 0, 0 };
+
+    return (XRenderColor){
+        .red   = rgba.r * 0xffff / rgba.a,
+        .green = rgba.g * 0xffff / rgba.a,
+        .blue  = rgba.b * 0xffff / rgba.a,
+        .alpha = rgba.a * 0x101,
+    };
+}
+
+// A solid color if start and stop are the same, a gradient going from the top to the bottom of the
+// bar otherwise
+Picture
+color_fill (const rgba_t rgba, const rgba_t stop)
 {
-    float i;
-    const int K = 25; // The number of steps
+    for (int i = 0; i < color_count; i++) {
+        if (color_cache[i].rgba.v == rgba.v && color_cache[i].stop.v == stop.v) {
+            stats.fill_hits++;
+            return color_cache[i].fill;
+        }
+    }
+
+    stats.fill_misses++;
+
+    if (color_count >= MAX_COLOR_CACHE)
+        color_cache_flush();
+
+    color_cache = grow_array(color_cache, &color_max, color_count + 1, sizeof(color_t));
 
-    for (i = 0.; i < 1.; i += (1. / K)) {
-        // Perform the linear interpolation magic
-        unsigned int rr = i * stop.r + (1. - i) * start.r;
-        unsigned int gg = i * stop.g + (1. - i) * start.g;
-        unsigned int bb = i * stop.b + (1. - i) * start.b;
+    color_t *col = &color_cache[color_count++];
 
-        // The alpha is ignored here
-        rgba_t step = {
-            .r = rr,
-            .g = gg,
-            .b = bb,
-            .a = 255,
+    col->rgba = rgba;
+    col->stop = stop;
+
+    if (rgba.v == stop.v) {
+        // The alpha channel is ignored as the color components are already premultiplied
+        const XRenderColor value = {
+            .red   = rgba.r * 0x101,
+            .green = rgba.g * 0x101,
+            .blue  = rgba.b * 0x101,
+            .alpha = 0xffff,
         };
 
-        xcb_change_gc(c, gc[GC_DRAW], XCB_GC_FOREGROUND, (const uint32_t []){ step.v });
-        xcb_poly_fill_rectangle(c, d, gc[GC_DRAW], 1,
-                               (const xcb_rectangle_t []){ { x, i * bh, width, bh / K + 1 } });
+        col->fill = XRenderCreateSolidFill(dpy, &value);
+    } else {
+        // The gradient stops are given without the premultiplication
+        const XLinearGradient line = { { 0, 0 }, { 0, XDoubleToFixed(bh) } };
+        const XFixed offset[2] = { XDoubleToFixed(0), XDoubleToFixed(1) };
+        const XRenderColor value[2] = { color_straight(rgba), color_straight(stop) };
+
+        col->fill = XRenderCreateLinearGradient(dpy, &line, offset, value, 2);
     }
 
-    xcb_change_gc(c, gc[GC_DRAW], XCB_GC_FOREGROUND, (const uint32_t []){ fgc.v });
+    return col->fill;
 }
 
 void
@@ -181,20 +607,24 @@ fill_rect (xcb_drawable_t d, xcb_gcontext_t _gc, int x, int y, int width, int he
 // Apparently xcb cannot seem to compose the right request for this call, hence we have to do it by
 // ourselves.
 // The funcion is taken from 'wmdia' (http://wmdia.sourceforge.net/)
+// The string is split in as many TEXTITEM16 as needed, so that a whole run of glyphs is sent with a
+// single request.
 xcb_void_cookie_t xcb_poly_text_16_simple(xcb_connection_t * c,
     xcb_drawable_t drawable, xcb_gcontext_t gc, int16_t x, int16_t y,
     uint32_t len, const uint16_t *str)
 {
-    static const xcb_protocol_request_t xcb_req = {
-        5,                // count
-        0,                // ext
-        XCB_POLY_TEXT_16, // opcode
-        1                 // isvoid
+    const int items = (len + TEXT_ITEM_MAX - 1) / TEXT_ITEM_MAX;
+    const xcb_protocol_request_t xcb_req = {
+        2 + items * 2 + 1,  // count
+        0,                  // ext
+        XCB_POLY_TEXT_16,   // opcode
+        1                   // isvoid
     };
-    struct iovec xcb_parts[7];
-    uint8_t xcb_lendelta[2];
+    struct iovec xcb_parts[2 + 2 + MAX_TEXT_ITEMS * 2 + 1];
+    uint8_t xcb_lendelta[MAX_TEXT_ITEMS][2];
     xcb_void_cookie_t xcb_ret;
     xcb_poly_text_8_request_t xcb_out;
+    size_t items_len = 0;
 
     xcb_out.pad0 = 0;
     xcb_out.drawable = drawable;
@@ -202,1205 +632,3504 @@ xcb_void_cookie_t xcb_poly_text_16_simple(xcb_connection_t * c,
     xcb_out.x = x;
     xcb_out.y = y;
 
-    xcb_lendelta[0] = len;
-    xcb_lendelta[1] = 0;
-
     xcb_parts[2].iov_base = (char *)&xcb_out;
     xcb_parts[2].iov_len = sizeof(xcb_out);
     xcb_parts[3].iov_base = 0;
     xcb_parts[3].iov_len = -xcb_parts[2].iov_len & 3;
 
-    xcb_parts[4].iov_base = xcb_lendelta;
-    xcb_parts[4].iov_len = sizeof(xcb_lendelta);
-    xcb_parts[5].iov_base = (char *)str;
-    xcb_parts[5].iov_len = len * sizeof(int16_t);
+    for (int i = 0; i < items; i++) {
+        const uint32_t item_len = min(len - i * TEXT_ITEM_MAX, TEXT_ITEM_MAX);
+
+        xcb_lendelta[i][0] = item_len;
+        xcb_lendelta[i][1] = 0;
+
+        xcb_parts[4 + i * 2].iov_base = xcb_lendelta[i];
+        xcb_parts[4 + i * 2].iov_len = sizeof(xcb_lendelta[i]);
+        xcb_parts[5 + i * 2].iov_base = (char *)(str + i * TEXT_ITEM_MAX);
+        xcb_parts[5 + i * 2].iov_len = item_len * sizeof(int16_t);
+
+        items_len += sizeof(xcb_lendelta[i]) + item_len * sizeof(int16_t);
+    }
 
-    xcb_parts[6].iov_base = 0;
-    xcb_parts[6].iov_len = -(xcb_parts[4].iov_len + xcb_parts[5].iov_len) & 3;
+    xcb_parts[4 + items * 2].iov_base = 0;
+    xcb_parts[4 + items * 2].iov_len = -items_len & 3;
 
     xcb_ret.sequence = xcb_send_request(c, 0, xcb_parts + 2, &xcb_req);
 
     return xcb_ret;
 }
 
+cp_entry_t *
+cp_map_slot (const cp_map_t *map, const uint32_t cp)
+{
+    unsigned int i = (cp * 2654435761u) & (map->size - 1);
 
-int
-xft_char_width_slot (uint16_t ch)
+    while (map->slot[i].cp && map->slot[i].cp != cp)
+        i = (i + 1) & (map->size - 1);
+
+    return &map->slot[i];
+}
+
+bool
+cp_map_get (const cp_map_t *map, const uint32_t cp, int *val)
 {
-    int slot = ch % MAX_WIDTHS;
-    while (xft_char[slot] != 0 && xft_char[slot] != ch)
-    {
-        slot = (slot + 1) % MAX_WIDTHS;
+    if (!map->size)
+        return false;
+
+    const cp_entry_t *e = cp_map_slot(map, cp);
+    if (!e->cp)
+        return false;
+
+    *val = e->val;
+    return true;
+}
+
+void
+cp_map_put (cp_map_t *map, const uint32_t cp, const int val)
+{
+    // Keep the load factor under 1/2 so that the probe sequences stay short
+    if ((map->used + 1) * 2 > map->size) {
+        cp_map_t tmp = { .size = map->size ? map->size * 2 : 64, .used = map->used };
+
+        tmp.slot = calloc(tmp.size, sizeof(cp_entry_t));
+        if (!tmp.slot) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < map->size; i++)
+            if (map->slot[i].cp)
+                *cp_map_slot(&tmp, map->slot[i].cp) = map->slot[i];
+
+        free(map->slot);
+        *map = tmp;
+    }
+
+    cp_entry_t *e = cp_map_slot(map, cp);
+    if (!e->cp) {
+        e->cp = cp;
+        map->used++;
     }
-    return slot;
+    e->val = val;
+}
+
+void
+cp_map_free (cp_map_t *map)
+{
+    free(map->slot);
+    *map = (cp_map_t){ 0 };
 }
 
-int xft_char_width (uint16_t ch, font_t *cur_font)
+void
+xft_fill_widths (font_t *font)
 {
-    int slot = xft_char_width_slot(ch);
-    if (!xft_char[slot]) {
-        XGlyphInfo gi;
-        FT_UInt glyph = XftCharIndex (dpy, cur_font->xft_ft, (FcChar32) ch);
-        XftFontLoadGlyphs (dpy, cur_font->xft_ft, FcFalse, &glyph, 1);
-        XftGlyphExtents (dpy, cur_font->xft_ft, &glyph, 1, &gi);
-        XftFontUnloadGlyphs (dpy, cur_font->xft_ft, &glyph, 1);
-        xft_char[slot] = ch;
-        xft_width[slot] = gi.xOff;
-        return gi.xOff;
-    } else if (xft_char[slot] == ch)
-        return xft_width[slot];
-    else
-        return 0;
+    FT_UInt glyph[DENSE_WIDTHS];
+    XGlyphInfo gi;
+
+    for (int i = 0; i < DENSE_WIDTHS; i++)
+        glyph[i] = XftCharIndex(dpy, font->xft_ft, (FcChar32) i);
+
+    // Load the whole range at once, those glyphs are going to be drawn anyway
+    XftFontLoadGlyphs(dpy, font->xft_ft, FcFalse, glyph, DENSE_WIDTHS);
+
+    for (int i = 0; i < DENSE_WIDTHS; i++) {
+        XftGlyphExtents(dpy, font->xft_ft, &glyph[i], 1, &gi);
+        font->dense_width[i] = gi.xOff;
+    }
 }
 
 int
-shift (monitor_t *mon, int x, int align, int ch_width)
+xft_char_width (uint32_t ch, font_t *cur_font)
 {
-    switch (align) {
-        case ALIGN_C:
-            xcb_copy_area(c, mon->pixmap, mon->pixmap, gc[GC_DRAW],
-                    mon->width / 2 - x / 2, 0,
-                    mon->width / 2 - (x + ch_width) / 2, 0,
-                    x, bh);
-            x = mon->width / 2 - (x + ch_width) / 2 + x;
-            break;
-        case ALIGN_R:
-            xcb_copy_area(c, mon->pixmap, mon->pixmap, gc[GC_DRAW],
-                    mon->width - x, 0,
-                    mon->width - x - ch_width, 0,
-                    x, bh);
-            x = mon->width - ch_width;
-            break;
+    XGlyphInfo gi;
+    int width;
+
+    if (ch < DENSE_WIDTHS) {
+        stats.width_hits++;
+        return cur_font->dense_width[ch];
     }
-    
-        /* Draw the background first */
-    fill_rect(mon->pixmap, gc[GC_CLEAR], x, 0, ch_width, bh);
-    return x;
+
+    if (cp_map_get(&cur_font->width_map, ch, &width)) {
+        stats.width_hits++;
+        return width;
+    }
+
+    stats.width_misses++;
+
+    // The glyph is kept loaded as it's about to be drawn
+    FT_UInt glyph = XftCharIndex (dpy, cur_font->xft_ft, (FcChar32) ch);
+    XftGlyphExtents (dpy, cur_font->xft_ft, &glyph, 1, &gi);
+    cp_map_put(&cur_font->width_map, ch, gi.xOff);
+
+    return gi.xOff;
 }
 
 void
-draw_lines (monitor_t *mon, int x, int w)
+draw_lines (monitor_t *mon, int x, int w, uint32_t attr)
 {
     /* We can render both at the same time */
-    if (attrs & ATTR_OVERL)
+    if (attr & ATTR_OVERL)
         fill_rect(mon->pixmap, gc[GC_ATTR], x, 0, w, bu);
-    if (attrs & ATTR_UNDERL)
+    if (attr & ATTR_UNDERL)
         fill_rect(mon->pixmap, gc[GC_ATTR], x, bh - bu, w, bu);
 }
 
-void
-draw_shift (monitor_t *mon, int x, int align, int w)
+int
+char_width (font_t *cur_font, uint32_t ch)
 {
-    x = shift(mon, x, align, w);
-    draw_lines(mon, x, w);
+    if (cur_font->xft_ft)
+        return xft_char_width(ch, cur_font);
+
+    return (cur_font->width_lut) ?
+        cur_font->width_lut[ch - cur_font->char_min].character_width:
+        cur_font->width;
 }
 
 int
-draw_char (monitor_t *mon, font_t *cur_font, int x, int align, uint16_t ch)
+run_baseline (const run_t *r)
+{
+    return bh / 2 + r->font->height / 2- r->font->descent + r->offset_y;
+}
+
+void
+draw_core_text (monitor_t *mon, int x, const run_t *r)
 {
-    int ch_width;
+    font_t *cur_font = r->font;
+    const uint32_t *glyph = &frame.glyph[r->glyph];
+    uint16_t str[MAX_RUN_LEN];
+
+    /* xcb accepts string in UCS-2 BE, so swap. The core fonts can't hold anything past the
+     * BMP so no glyph is lost here */
+    for (int i = 0; i < r->len; i++)
+        str[i] = (glyph[i] >> 8 & 0xff) | (glyph[i] & 0xff) << 8;
+
+    update_gc(GC_DRAW, r->fg);
+    if (gc_font != cur_font->ptr) {
+        gc_font = cur_font->ptr;
+        xcb_change_gc(c, gc[GC_DRAW] , XCB_GC_FONT, (const uint32_t []) {
+            cur_font->ptr
+        });
+    }
 
-    if (cur_font->xft_ft) {
-        ch_width = xft_char_width(ch, cur_font);
+    // The coordinates here are those of the baseline
+    xcb_poly_text_16_simple(c, mon->pixmap, gc[GC_DRAW],
+                        x, run_baseline(r),
+                        r->len, str);
+}
+
+void
+draw_text (monitor_t *mon, int x, const run_t *r)
+{
+    if (r->font->xft_ft) {
+        // The glyphs are uploaded to the font glyphset the first time they're used, the whole
+        // run is then a single CompositeGlyphs request
+        XftTextRender32(dpy, PictOpOver, color_fill(r->fg, r->fg), r->font->xft_ft, mon->picture,
+                0, 0, x, run_baseline(r), &frame.glyph[r->glyph], r->len);
     } else {
-        ch_width = (cur_font->width_lut) ?
-            cur_font->width_lut[ch - cur_font->char_min].character_width:
-            cur_font->width;
+        draw_core_text(mon, x, r);
     }
+}
+
+void
+draw_run (monitor_t *mon, int x, const run_t *r)
+{
+    font_t *cur_font = r->font;
 
-    x = shift(mon, x, align, ch_width);
+    stats.runs++;
+    stats.glyphs += r->len;
 
-    int y = bh / 2 + cur_font->height / 2- cur_font->descent + offsets_y[offset_y_index];
-    if (cur_font->xft_ft) {
-        XftDrawString16 (xft_draw, &sel_fg, cur_font->xft_ft, x,y, &ch, 1);
+    /* Draw the background first */
+    if (r->bg.v == r->bg_stop.v) {
+        update_gc(GC_CLEAR, r->bg);
+        fill_rect(mon->pixmap, gc[GC_CLEAR], x, 0, r->width, bh);
     } else {
-        /* xcb accepts string in UCS-2 BE, so swap */
-        ch = (ch >> 8) | (ch << 8);
-        
-        // The coordinates here are those of the baseline
-        xcb_poly_text_16_simple(c, mon->pixmap, gc[GC_DRAW],
-                            x, y,
-                            1, &ch);
+        XRenderComposite(dpy, PictOpSrc, color_fill(r->bg, r->bg_stop), None, mon->picture,
+                0, 0, 0, 0, x, 0, r->width, bh);
     }
 
-    draw_lines(mon, x, ch_width);
+    if (cur_font)
+        draw_text(mon, x, r);
 
-    return ch_width;
+    if (r->attrs)
+        update_gc(GC_ATTR, r->ug);
+    draw_lines(mon, x, r->width, r->attrs);
 }
 
-rgba_t
-parse_color (const char *str, char **end, const rgba_t def)
+#if WITH_SHM
+// The MIT-SHM backend renders the runs in a buffer shared with the server, the damaged regions are
+// then pushed to the pixmap at once instead of sending a request for every fill and string.
+
+void
+shm_fill (monitor_t *mon, int x, int y, int width, int height, const rgba_t color)
 {
-    int string_len;
-    char *ep;
+    const int x1 = min(x + width, mon->width);
+    const int y1 = min(y + height, bh);
 
-    if (!str)
-        return def;
+    for (int j = max(y, 0); j < y1; j++) {
+        uint32_t *row = mon->shm_data + j * mon->width;
+        for (int i = max(x, 0); i < x1; i++)
+            row[i] = color.v;
+    }
+}
 
-    // Reset
-    if (str[0] == '-') {
-        if (end)
-            *end = (char *)str + 1;
+// Pick the FreeType flags the same way Xft does from the font pattern
+void
+shm_font_setup (font_t *font)
+{
+    FcPattern *pat = font->xft_ft->pattern;
+    FcBool antialias = FcTrue, hinting = FcTrue, autohint = FcFalse, embedded = FcTrue;
+    int hintstyle = FC_HINT_FULL, rgba = FC_RGBA_UNKNOWN;
+    FT_Int32 flags = FT_LOAD_DEFAULT;
+
+    FcPatternGetBool(pat, FC_ANTIALIAS, 0, &antialias);
+    FcPatternGetBool(pat, FC_HINTING, 0, &hinting);
+    FcPatternGetBool(pat, FC_AUTOHINT, 0, &autohint);
+    FcPatternGetBool(pat, FC_EMBEDDED_BITMAP, 0, &embedded);
+    FcPatternGetInteger(pat, FC_HINT_STYLE, 0, &hintstyle);
+    FcPatternGetInteger(pat, FC_RGBA, 0, &rgba);
+
+    if (!hinting || hintstyle == FC_HINT_NONE)
+        flags |= FT_LOAD_NO_HINTING;
+    if (!antialias)
+        flags |= FT_LOAD_TARGET_MONO;
+    else if (hintstyle > FC_HINT_NONE && hintstyle < FC_HINT_FULL)
+        flags |= FT_LOAD_TARGET_LIGHT;
+    if (autohint)
+        flags |= FT_LOAD_FORCE_AUTOHINT;
+    if (!embedded)
+        flags |= FT_LOAD_NO_BITMAP;
+
+    // The buffer only knows a single coverage value per pixel
+    font->shm_server = antialias && (rgba == FC_RGBA_RGB || rgba == FC_RGBA_BGR ||
+                                     rgba == FC_RGBA_VRGB || rgba == FC_RGBA_VBGR);
+    font->shm_load_flags = flags;
+    font->shm_setup = true;
+}
 
-        return def;
-    }
+shm_glyph_t *
+shm_glyph_get (font_t *font, const uint32_t ch)
+{
+    shm_glyph_t *g;
+    FT_Face face;
+    int idx;
+
+    if (cp_map_get(&font->shm_map, ch, &idx))
+        return &font->shm_glyph[idx];
+
+    font->shm_glyph = grow_array(font->shm_glyph, &font->shm_max_glyphs, font->shm_glyphs + 1, sizeof(shm_glyph_t));
+    g = &font->shm_glyph[font->shm_glyphs];
+    memset(g, 0, sizeof(shm_glyph_t));
+
+    if (!font->shm_setup)
+        shm_font_setup(font);
+
+    // A glyph that can't be rendered is cached as an empty one
+    face = XftLockFace(font->xft_ft);
+    if (face && !FT_Load_Glyph(face, XftCharIndex(dpy, font->xft_ft, ch), font->shm_load_flags | FT_LOAD_RENDER | FT_LOAD_COLOR)) {
+        const FT_Bitmap *bm = &face->glyph->bitmap;
+
+        g->left = face->glyph->bitmap_left;
+        g->top = face->glyph->bitmap_top;
+        g->width = bm->width;
+        g->height = bm->rows;
+        g->color = bm->pixel_mode == FT_PIXEL_MODE_BGRA;
+
+        if (g->width && g->height && !g->color) {
+            g->bits = calloc(g->width * g->height, 1);
+            if (!g->bits) {
+                fprintf(stderr, "Failed to allocate new glyph\n");
+                exit(EXIT_FAILURE);
+            }
+        }
 
-    // Hex representation
-    if (str[0] != '#') {
-        if (end)
-            *end = (char *)str;
+        for (int j = 0; j < g->height && g->bits; j++) {
+            const uint8_t *src = bm->buffer + j * bm->pitch;
+            uint8_t *dst = g->bits + j * g->width;
 
-        fprintf(stderr, "Invalid color specified\n");
-        return def;
+            if (bm->pixel_mode == FT_PIXEL_MODE_GRAY)
+                memcpy(dst, src, g->width);
+            else if (bm->pixel_mode == FT_PIXEL_MODE_MONO)
+                for (int i = 0; i < g->width; i++)
+                    dst[i] = (src[i >> 3] >> (7 - (i & 7)) & 1) ? 255 : 0;
+        }
     }
+    if (face)
+        XftUnlockFace(font->xft_ft);
 
-    errno = 0;
-    rgba_t tmp = (rgba_t)(uint32_t)strtoul(str + 1, &ep, 16);
+    cp_map_put(&font->shm_map, ch, font->shm_glyphs);
 
-    if (end)
-        *end = ep;
+    return &font->shm_glyph[font->shm_glyphs++];
+}
 
-    // Some error checking is definitely good
-    if (errno) {
-        fprintf(stderr, "Invalid color specified\n");
-        return def;
-    }
+void
+shm_draw_glyph (monitor_t *mon, const int x, const int y, const shm_glyph_t *g, const rgba_t fg)
+{
+    for (int j = max(-y, 0); j < g->height && y + j < bh; j++) {
+        const uint8_t *cov = g->bits + j * g->width;
+        uint32_t *row = mon->shm_data + (y + j) * mon->width + x;
 
-    string_len = ep - (str + 1);
+        for (int i = max(-x, 0); i < g->width && x + i < mon->width; i++) {
+            const unsigned int a = cov[i];
 
-    switch (string_len) {
-        case 3:
-            // Expand the #rgb format into #rrggbb (aa is set to 0xff)
-            tmp.v = (tmp.v & 0xf00) * 0x1100
-                  | (tmp.v & 0x0f0) * 0x0110
-                  | (tmp.v & 0x00f) * 0x0011;
-        case 6:
-            // If the code is in #rrggbb form then assume it's opaque
-            tmp.a = 255;
-            break;
-        case 7:
-        case 8:
-            // Colors in #aarrggbb format, those need no adjustments
-            break;
-        default:
-            fprintf(stderr, "Invalid color specified\n");
-            return def;
+            if (a == 0)
+                continue;
+
+            if (a == 255) {
+                row[i] = fg.v;
+                continue;
+            }
+
+            // Same as the Over operator Xft uses, the colors are premultiplied already
+            rgba_t d = { .v = row[i] };
+            d.r = (fg.r * a + d.r * (255 - a) + 127) / 255;
+            d.g = (fg.g * a + d.g * (255 - a) + 127) / 255;
+            d.b = (fg.b * a + d.b * (255 - a) + 127) / 255;
+            d.a = (fg.a * a + d.a * (255 - a) + 127) / 255;
+            row[i] = d.v;
+        }
     }
+}
 
-    // Premultiply the alpha in
-    if (tmp.a) {
-        // The components are clamped automagically as the rgba_t is made of uint8_t
-        return (rgba_t){
-            .r = (tmp.r * tmp.a) / 255,
-            .g = (tmp.g * tmp.a) / 255,
-            .b = (tmp.b * tmp.a) / 255,
-            .a = tmp.a,
-        };
+// The runs the buffer can't hold as Xft would draw them are drawn by the server once the buffer has
+// been pushed, so are the ones set with the core fonts
+bool
+shm_run_on_server (const run_t *r)
+{
+    font_t *font = r->font;
+
+    if (!font)
+        return false;
+    if (!font->xft_ft)
+        return true;
+
+    if (!font->shm_setup)
+        shm_font_setup(font);
+    if (font->shm_server)
+        return true;
+
+    for (int i = 0; i < r->len; i++) {
+        if (shm_glyph_get(font, frame.glyph[r->glyph + i])->color)
+            return true;
     }
 
-    return (rgba_t)0U;
+    return false;
 }
 
 void
-set_attribute (const char modifier, const char attribute)
+shm_draw_run (monitor_t *mon, int x, const run_t *r)
 {
-    int pos = indexof(attribute, "ou");
+    font_t *cur_font = r->font;
+    const uint32_t *glyph = &frame.glyph[r->glyph];
 
-    if (pos < 0) {
-        fprintf(stderr, "Invalid attribute \"%c\" found\n", attribute);
-        return;
+    stats.runs++;
+    stats.glyphs += r->len;
+
+    if (r->bg.v == r->bg_stop.v) {
+        shm_fill(mon, x, 0, r->width, bh, r->bg);
+    } else {
+        for (int j = 0; j < bh; j++)
+            shm_fill(mon, x, j, r->width, 1, color_lerp(r->bg, r->bg_stop, j, bh));
     }
 
-    switch (modifier) {
-    case '+':
-        attrs |= (1u<<pos);
-        break;
-    case '-':
-        attrs &=~(1u<<pos);
-        break;
-    case '!':
-        attrs ^= (1u<<pos);
-        break;
+    // Some runs are rendered by the server, see frame_draw
+    if (cur_font && !shm_run_on_server(r)) {
+        const int y = run_baseline(r);
+        // The text is always opaque, as in color_fill
+        rgba_t fg = r->fg;
+        fg.a = 255;
+
+        for (int i = 0, pen = x; i < r->len; i++) {
+            const shm_glyph_t *g = shm_glyph_get(cur_font, glyph[i]);
+
+            shm_draw_glyph(mon, pen + g->left, y - g->top, g, fg);
+            pen += char_width(cur_font, glyph[i]);
+        }
     }
+
+    if (r->attrs & ATTR_OVERL)
+        shm_fill(mon, x, 0, r->width, bu, r->ug);
+    if (r->attrs & ATTR_UNDERL)
+        shm_fill(mon, x, bh - bu, r->width, bu, r->ug);
 }
 
+void
+shm_push (monitor_t *mon)
+{
+    // The regions outside the damage may hold text drawn by the server, leave them alone
+    for (int i = 0; i < mon->damage_count; i++) {
+        const xcb_rectangle_t *d = &mon->damage[i];
+
+        // Only the last one asks for a completion event, the requests are processed in order
+        xcb_shm_put_image(c, mon->pixmap, gc[GC_DRAW], mon->width, bh,
+                d->x, d->y, d->width, d->height, d->x, d->y,
+                shm_depth, XCB_IMAGE_FORMAT_Z_PIXMAP, i == mon->damage_count - 1, mon->shm_seg, 0);
+    }
+
+    if (mon->damage_count)
+        mon->shm_busy = true;
+}
 
-area_t *
-area_get (xcb_window_t win, const int btn, const int x)
+bool
+shm_busy (void)
 {
-    // Looping backwards ensures that we get the innermost area first
-    for (int i = area_stack.at - 1; i >= 0; i--) {
-        area_t *a = &area_stack.area[i];
-        if (a->window == win && a->button == btn && x >= a->begin && x < a->end)
-            return a;
+    for (monitor_t *mon = monhead; mon; mon = mon->next) {
+        if (mon->shm_busy)
+            return true;
     }
-    return NULL;
+    return false;
 }
 
 void
-area_shift (xcb_window_t win, const int align, int delta)
+shm_attach (monitor_t *mon)
 {
-    if (align == ALIGN_L)
+    xcb_generic_error_t *err;
+    int id;
+
+    // The monitor is drawn with the core requests if anything goes wrong
+    id = shmget(IPC_PRIVATE, mon->width * bh * sizeof(uint32_t), IPC_CREAT | 0600);
+    if (id < 0)
         return;
-    if (align == ALIGN_C)
-        delta /= 2;
 
-    for (int i = 0; i < area_stack.at; i++) {
-        area_t *a = &area_stack.area[i];
-        if (a->window == win && a->align == align && !a->active) {
-            a->begin -= delta;
-            a->end -= delta;
-        }
+    mon->shm_data = shmat(id, NULL, 0);
+    if (mon->shm_data == (void *)-1) {
+        shmctl(id, IPC_RMID, NULL);
+        mon->shm_data = NULL;
+        return;
     }
-}
 
-bool
-area_add (char *str, const char *optend, char **end, monitor_t *mon, const int x, const int align, const int button)
-{
-    int i;
-    char *trail;
-    area_t *a;
+    mon->shm_seg = xcb_generate_id(c);
+    err = xcb_request_check(c, xcb_shm_attach_checked(c, mon->shm_seg, id, 0));
 
-    // A wild close area tag appeared!
-    if (*str != ':') {
-        *end = str;
+    // The segment is gone as soon as both sides detach from it
+    shmctl(id, IPC_RMID, NULL);
 
-        // Find most recent unclosed area.
-        for (i = area_stack.at - 1; i >= 0 && !area_stack.area[i].active; i--)
-            ;
-        a = &area_stack.area[i];
-
-        // Basic safety checks
-        if (!a->cmd || a->align != align || a->window != mon->window) {
-            fprintf(stderr, "Invalid geometry for the clickable area\n");
-            return false;
-        }
+    if (err) {
+        fprintf(stderr, "Couldn't attach the shared memory segment\n");
+        shmdt(mon->shm_data);
+        mon->shm_data = NULL;
+        free(err);
+    }
+}
 
-        const int size = x - a->begin;
+void
+shm_detach (monitor_t *mon)
+{
+    if (!mon->shm_data)
+        return;
 
-        switch (align) {
-            case ALIGN_L:
-                a->end = x;
-                break;
-            case ALIGN_C:
-                a->begin = mon->width / 2 - size / 2 + a->begin / 2;
-                a->end = a->begin + size;
-                break;
-            case ALIGN_R:
-                // The newest is the rightmost one
-                a->begin = mon->width - size;
-                a->end = mon->width;
-                break;
-        }
+    xcb_shm_detach(c, mon->shm_seg);
+    shmdt(mon->shm_data);
+    mon->shm_data = NULL;
+}
 
-        a->active = false;
-        return true;
-    }
+void
+shm_init (void)
+{
+    const xcb_query_extension_reply_t *qe_reply;
+    xcb_shm_query_version_reply_t *qv_reply;
+    xcb_format_iterator_t it;
+    const int depth = (visual == scr->root_visual) ? scr->root_depth : 32;
 
-    if (area_stack.at + 1 > area_stack.max) {
-        fprintf(stderr, "Cannot add any more clickable areas (used %d/%d)\n", 
-                area_stack.at, area_stack.max);
-        return false;
-    }
-    a = &area_stack.area[area_stack.at++];
+    qe_reply = xcb_get_extension_data(c, &xcb_shm_id);
+    if (!qe_reply || !qe_reply->present)
+        return;
 
-    // Found the closing : and check if it's just an escaped one
-    for (trail = strchr(++str, ':'); trail && trail[-1] == '\\'; trail = strchr(trail + 1, ':'))
-        ;
+    qv_reply = xcb_shm_query_version_reply(c, xcb_shm_query_version(c), NULL);
+    if (!qv_reply)
+        return;
+    free(qv_reply);
 
-    // Find the trailing : and make sure it's within the formatting block, also reject empty commands
-    if (!trail || str == trail || trail > optend) {
-        *end = str;
-        return false;
+    // The buffer holds a 32 bit word per pixel, in the client byte order as the server is local
+    for (it = xcb_setup_pixmap_formats_iterator(xcb_get_setup(c)); it.rem; xcb_format_next(&it)) {
+        if (it.data->depth == depth && it.data->bits_per_pixel == 32) {
+            shm_base = qe_reply->first_event;
+            shm_depth = depth;
+            break;
+        }
     }
+}
+#endif
 
-    *trail = '\0';
+#if WITH_PRESENT
+// Bring the pixmap the next frame is drawn on up to date and draw on it
+void
+present_begin (monitor_t *mon)
+{
+    const int b = mon->back;
 
-    // Sanitize the user command by unescaping all the :
-    for (char *needle = str; *needle; needle++) {
-        int delta = trail - &needle[1];
-        if (needle[0] == '\\' && needle[1] == ':') {
-            memmove(&needle[0], &needle[1], delta);
-            needle[delta] = 0;
-        }
+    // It holds the frame before the last one, what the last one changed is copied over
+    for (int i = 0; i < mon->present_last_count; i++) {
+        const xcb_rectangle_t *r = &mon->present_last[i];
+        xcb_copy_area(c, mon->pixmap, mon->buffer[b], gc[GC_DRAW], r->x, r->y, r->x, r->y, r->width, r->height);
     }
 
-    // This is a pointer to the string buffer allocated in the main
-    a->cmd = str;
-    a->active = true;
-    a->align = align;
-    a->begin = x;
-    a->window = mon->window;
-    a->button = button;
-
-    *end = trail + 1;
+    mon->pixmap = mon->buffer[b];
+    mon->picture = mon->buffer_picture[b];
+}
 
-    return true;
+void
+present_frame (monitor_t *mon)
+{
+    mon->present_last = grow_array(mon->present_last, &mon->present_last_max, mon->damage_count, sizeof(xcb_rectangle_t));
+    memcpy(mon->present_last, mon->damage, mon->damage_count * sizeof(xcb_rectangle_t));
+    mon->present_last_count = mon->damage_count;
+
+    // Shown at the next vertical blank, no sooner
+    xcb_present_pixmap(c, mon->window, mon->pixmap, ++mon->present_serial, XCB_NONE, XCB_NONE, 0, 0,
+            XCB_NONE, XCB_NONE, XCB_NONE, XCB_PRESENT_OPTION_NONE, 0, 0, 0, 0, NULL);
+
+    mon->present_busy = true;
+    mon->present_at = now_ms();
+    mon->buffer_idle[mon->back] = false;
+    mon->back ^= 1;
 }
 
+// The next frame would only replace one that isn't on screen yet, or it would be drawn on a pixmap
+// the server is still reading
 bool
-font_has_glyph (font_t *font, const uint16_t c)
+present_busy (void)
 {
-    if (font->xft_ft) {
-        if (XftCharExists(dpy, font->xft_ft, (FcChar32) c)) {
-            return true;
-        } else {
-            return false;
-        }
+    const int64_t now = now_ms();
 
+    for (monitor_t *mon = monhead; mon; mon = mon->next) {
+        if (!mon->buffer[1] || (!mon->present_busy && mon->buffer_idle[mon->back]))
+            continue;
+        if (now - mon->present_at < PRESENT_TIMEOUT)
+            return true;
+        // The events aren't coming, stop waiting for them
+        mon->present_busy = false;
+        mon->buffer_idle[0] = mon->buffer_idle[1] = true;
     }
-
-    if (c < font->char_min || c > font->char_max)
-        return false;
-
-    if (font->width_lut && font->width_lut[c - font->char_min].character_width == 0)
-        return false;
-
-    return true;
+    return false;
 }
 
-font_t *
-select_drawable_font (const uint16_t c)
+void
+present_event (const xcb_ge_generic_event_t *ev)
 {
-    // If the user has specified a font to use, try that first.
-    if (font_index != -1 && font_has_glyph(font_list[font_index - 1], c)) {
-        offset_y_index = font_index - 1;
-        return font_list[font_index - 1];
-    }
+    const xcb_present_complete_notify_event_t *complete_ev = (const xcb_present_complete_notify_event_t *)ev;
+    const xcb_present_idle_notify_event_t *idle_ev = (const xcb_present_idle_notify_event_t *)ev;
 
-    // If the end is reached without finding an appropriate font, return NULL.
-    // If the font can draw the character, return it.
-    for (int i = 0; i < font_count; i++) {
-        if (font_has_glyph(font_list[i], c)) {
-            offset_y_index = i;
-            return font_list[i];
+    for (monitor_t *mon = monhead; mon; mon = mon->next) {
+        if (ev->event_type == XCB_PRESENT_COMPLETE_NOTIFY && mon->window == complete_ev->window) {
+            // Only the newest frame matters
+            if (complete_ev->serial == mon->present_serial)
+                mon->present_busy = false;
+        }
+        if (ev->event_type == XCB_PRESENT_IDLE_NOTIFY && mon->window == idle_ev->window) {
+            for (int i = 0; i < 2; i++) {
+                if (mon->buffer[i] == idle_ev->pixmap)
+                    mon->buffer_idle[i] = true;
+            }
         }
     }
-    return NULL;
 }
 
-
 void
-parse (char *text)
+present_attach (monitor_t *mon)
 {
-    font_t *cur_font;
-    monitor_t *cur_mon;
-    int pos_x, align, button;
-    char *p = text, *block_end, *ep;
-    rgba_t tmp;
+    const int depth = (visual == scr->root_visual) ? XCB_COPY_FROM_PARENT : 32;
 
-    pos_x = 0;
-    align = ALIGN_L;
-    cur_mon = monhead;
+    mon->buffer[0] = mon->pixmap;
+    mon->buffer_picture[0] = mon->picture;
 
-    // Reset the stack position
-    area_stack.at = 0;
+    mon->buffer[1] = xcb_generate_id(c);
+    xcb_create_pixmap(c, depth, mon->buffer[1], mon->window, mon->width, bh);
+    mon->buffer_picture[1] = XRenderCreatePicture(dpy, mon->buffer[1], pict_format, 0, NULL);
 
-    for (monitor_t *m = monhead; m != NULL; m = m->next)
-        fill_rect(m->pixmap, gc[GC_CLEAR], 0, 0, m->width, bh);
+    mon->back = 1;
+    mon->buffer_idle[0] = mon->buffer_idle[1] = true;
 
-    /* Create xft drawable */
-    if (!(xft_draw = XftDrawCreate (dpy, cur_mon->pixmap, visual_ptr , colormap))) {
-        fprintf(stderr, "Couldn't create xft drawable\n");
+    xcb_present_select_input(c, xcb_generate_id(c), mon->window,
+            XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY | XCB_PRESENT_EVENT_MASK_IDLE_NOTIFY);
+}
+
+// Free the pixmap that isn't the current one, monitor_destroy takes care of that
+void
+present_detach (monitor_t *mon)
+{
+    for (int i = 0; i < 2; i++) {
+        if (mon->buffer[i] && mon->buffer[i] != mon->pixmap) {
+            XRenderFreePicture(dpy, mon->buffer_picture[i]);
+            xcb_free_pixmap(c, mon->buffer[i]);
+        }
     }
+    free(mon->present_last);
+}
 
-    for (;;) {
-        if (*p == '\0' || *p == '\n')
-			break;
+void
+present_init (void)
+{
+    const xcb_query_extension_reply_t *qe_reply;
+    xcb_present_query_version_reply_t *qv_reply;
 
-        if (p[0] == '%' && p[1] == '{' && (block_end = strchr(p++, '}'))) {
-            p++;
-            while (p < block_end) {
-                int w;
-                while (isspace(*p))
-                    p++;
+    qe_reply = xcb_get_extension_data(c, &xcb_present_id);
+    if (!qe_reply || !qe_reply->present)
+        return;
 
-                switch (*p++) {
-                    case '+': set_attribute('+', *p++); break;
-                    case '-': set_attribute('-', *p++); break;
-                    case '!': set_attribute('!', *p++); break;
+    qv_reply = xcb_present_query_version_reply(c, xcb_present_query_version(c, 1, 0), NULL);
+    if (!qv_reply)
+        return;
+    free(qv_reply);
 
-                    case 'R':
-                              tmp = fgc;
-                              fgc = bgc;
-                              bgc = tmp;
-                              update_gc();
-                              break;
+    present_opcode = qe_reply->major_opcode;
+}
+#endif
 
-                    case 'l': pos_x = 0; align = ALIGN_L; break;
-                    case 'c': pos_x = 0; align = ALIGN_C; break;
-                    case 'r': pos_x = 0; align = ALIGN_R; break;
+rgba_t
+parse_color (const char *str, char **end, const rgba_t def)
+{
+    int string_len;
+    char *ep;
 
-                    case 'A':
-                              button = XCB_BUTTON_INDEX_1;
-                              // The range is 1-5
-                              if (isdigit(*p) && (*p > '0' && *p < '6'))
-                                  button = *p++ - '0';
-                              if (!area_add(p, block_end, &p, cur_mon, pos_x, align, button))
-                                  return;
-                              break;
+    if (!str)
+        return def;
 
-                    case 'B': bgc = parse_color(p, &p, dbgc); update_gc(); break;
-                    case 'F': fgc = parse_color(p, &p, dfgc); update_gc(); break;
-                    case 'U': ugc = parse_color(p, &p, dugc); update_gc(); break;
+    // Reset
+    if (str[0] == '-') {
+        if (end)
+            *end = (char *)str + 1;
 
-                    case 'S':
-                              if (*p == '+' && cur_mon->next)
-                              { cur_mon = cur_mon->next; }
-                              else if (*p == '-' && cur_mon->prev)
-                              { cur_mon = cur_mon->prev; }
-                              else if (*p == 'f')
-                              { cur_mon = monhead; }
-                              else if (*p == 'l')
-                              { cur_mon = montail ? montail : monhead; }
-                              else if (isdigit(*p))
-                              { cur_mon = monhead;
-                                for (int i = 0; i != *p-'0' && cur_mon->next; i++)
-                                    cur_mon = cur_mon->next;
-                              }
-                              else
-                              { p++; continue; }
-					          XftDrawDestroy (xft_draw);
-					          if (!(xft_draw = XftDrawCreate (dpy, cur_mon->pixmap, visual_ptr , colormap ))) {
-						        fprintf(stderr, "Couldn't create xft drawable\n");
-					          }
+        return def;
+    }
 
-                              p++;
-                              pos_x = 0;
-                              break;
-                    case 'O':
-                              errno = 0;
-                              w = (int) strtoul(p, &p, 10);
-                              if (errno)
-                                  continue;
+    // Hex representation
+    if (str[0] != '#') {
+        if (end)
+            *end = (char *)str;
 
-                              draw_shift(cur_mon, pos_x, align, w);
+        fprintf(stderr, "Invalid color specified\n");
+        return def;
+    }
 
-                              pos_x += w;
-                              area_shift(cur_mon->window, align, w);
-                              break;
+    errno = 0;
+    rgba_t tmp = (rgba_t)(uint32_t)strtoul(str + 1, &ep, 16);
 
-                    case 'T':
-                              if (*p == '-') { //Reset to automatic font selection
-                                  font_index = -1;
-                                  p++;
-                                  break;
-                              } else if (isdigit(*p)) {
-                                  font_index = (int)strtoul(p, &ep, 10);
-                                  // User-specified 'font_index' ∊ (0,font_count]
-                                  // Otherwise just fallback to the automatic font selection
-                                  if (!font_index || font_index > font_count)
-                                  font_index = -1;
-                                  p = ep;
-                                  break;
-                              } else {
-                                  fprintf(stderr, "Invalid font slot \"%c\"\n", *p++); //Swallow the token
-                                  break;
-                              }
+    if (end)
+        *end = ep;
 
-                    // In case of error keep parsing after the closing }
-                    default:
-                        p = block_end;
-                }
-            }
-            // Eat the trailing }
-            p++;
-        } else { // utf-8 -> ucs-2
-            uint8_t *utf = (uint8_t *)p;
-            uint16_t ucs;
-
-            // ASCII
-            if (utf[0] < 0x80) {
-                ucs = utf[0];
-                p  += 1;
-            }
-            // Two byte utf8 sequence
-            else if ((utf[0] & 0xe0) == 0xc0) {
-                ucs = (utf[0] & 0x1f) << 6 | (utf[1] & 0x3f);
-                p += 2;
-            }
-            // Three byte utf8 sequence
-            else if ((utf[0] & 0xf0) == 0xe0) {
-                ucs = (utf[0] & 0xf) << 12 | (utf[1] & 0x3f) << 6 | (utf[2] & 0x3f);
-                p += 3;
-            }
-            // Four byte utf8 sequence
-            else if ((utf[0] & 0xf8) == 0xf0) {
-                ucs = 0xfffd;
-                p += 4;
-            }
-            // Five byte utf8 sequence
-            else if ((utf[0] & 0xfc) == 0xf8) {
-                ucs = 0xfffd;
-                p += 5;
-            }
-            // Six byte utf8 sequence
-            else if ((utf[0] & 0xfe) == 0xfc) {
-                ucs = 0xfffd;
-                p += 6;
-            }
-            // Not a valid utf-8 sequence
-            else {
-                ucs = utf[0];
-                p += 1;
-            }
+    // Some error checking is definitely good
+    if (errno) {
+        fprintf(stderr, "Invalid color specified\n");
+        return def;
+    }
 
-            cur_font = select_drawable_font(ucs);
-            if (!cur_font)
-                continue;
+    string_len = ep - (str + 1);
 
-            if(cur_font->ptr)
-                xcb_change_gc(c, gc[GC_DRAW] , XCB_GC_FONT, (const uint32_t []) {
-                cur_font->ptr
-            });
-            int w = draw_char(cur_mon, cur_font, pos_x, align, ucs);
+    switch (string_len) {
+        case 3:
+            // Expand the #rgb format into #rrggbb (aa is set to 0xff)
+            tmp.v = (tmp.v & 0xf00) * 0x1100
+                  | (tmp.v & 0x0f0) * 0x0110
+                  | (tmp.v & 0x00f) * 0x0011;
+        case 6:
+            // If the code is in #rrggbb form then assume it's opaque
+            tmp.a = 255;
+            break;
+        case 7:
+        case 8:
+            // Colors in #aarrggbb format, those need no adjustments
+            break;
+        default:
+            fprintf(stderr, "Invalid color specified\n");
+            return def;
+    }
 
-            pos_x += w;
-            area_shift(cur_mon->window, align, w);
-        }
+    // Premultiply the alpha in
+    if (tmp.a) {
+        // The components are clamped automagically as the rgba_t is made of uint8_t
+        return (rgba_t){
+            .r = (tmp.r * tmp.a) / 255,
+            .g = (tmp.g * tmp.a) / 255,
+            .b = (tmp.b * tmp.a) / 255,
+            .a = tmp.a,
+        };
     }
-    XftDrawDestroy (xft_draw);
+
+    return (rgba_t)0U;
 }
 
 void
-font_load (const char *pattern)
+set_attribute (const char modifier, const char attribute)
 {
-    if (font_count >= MAX_FONT_COUNT) {
-        fprintf(stderr, "Max font count reached. Could not load font \"%s\"\n", pattern);
-        return;
-    }
-
-    xcb_query_font_cookie_t queryreq;
-    xcb_query_font_reply_t *font_info;
-    xcb_void_cookie_t cookie;
-    xcb_font_t font;
-
-    font = xcb_generate_id(c);
-
-    font_t *ret = calloc(1, sizeof(font_t));
+    int pos = indexof(attribute, "ou");
 
-    if (!ret)
+    if (pos < 0) {
+        fprintf(stderr, "Invalid attribute \"%c\" found\n", attribute);
         return;
+    }
 
-    cookie = xcb_open_font_checked(c, font, strlen(pattern), pattern);
-    if (!xcb_request_check (c, cookie)) {
-        queryreq = xcb_query_font(c, font);
-        font_info = xcb_query_font_reply(c, queryreq, NULL);
-
-        ret->xft_ft = NULL;
-        ret->ptr = font;
-        ret->descent = font_info->font_descent;
-        ret->height = font_info->font_ascent + font_info->font_descent;
-        ret->width = font_info->max_bounds.character_width;
-        ret->char_max = font_info->max_byte1 << 8 | font_info->max_char_or_byte2;
-        ret->char_min = font_info->min_byte1 << 8 | font_info->min_char_or_byte2;
-        // Copy over the width lut as it's part of font_info
-        int lut_size = sizeof(xcb_charinfo_t) * xcb_query_font_char_infos_length(font_info);
+    switch (modifier) {
+    case '+':
+        attrs |= (1u<<pos);
+        break;
+    case '-':
+        attrs &=~(1u<<pos);
+        break;
+    case '!':
+        attrs ^= (1u<<pos);
+        break;
+    }
+}
+
+
+// Where a block starts on a monitor, the mirrored ones are aligned again on every monitor
+int
+block_x (const block_t *b, const monitor_t *mon)
+{
+    if (b->mon != &mirror)
+        return b->x;
+
+    switch (b->align) {
+        case ALIGN_C:
+            return mon->width / 2 - b->width / 2;
+        case ALIGN_R:
+            return mon->width - b->width;
+    }
+
+    return 0;
+}
+
+int
+int_sort_cb (const void *p1, const void *p2)
+{
+    return *(const int *)p1 - *(const int *)p2;
+}
+
+// Find the segment containing x, -1 if none does
+int
+area_index_find (const area_index_t *idx, const int x)
+{
+    int lo = 0, hi = idx->count;
+
+    if (!idx->count || x < idx->edge[0] || x >= idx->edge[idx->count])
+        return -1;
+
+    while (hi - lo > 1) {
+        const int mid = (lo + hi) / 2;
+        if (x < idx->edge[mid])
+            hi = mid;
+        else
+            lo = mid;
+    }
+
+    return lo;
+}
+
+void
+area_index_build (monitor_t *mon)
+{
+    area_index_t *idx = &mon->areas;
+    int n = 0;
+
+    // Collect the edges of every closed area on this monitor
+    idx->edge = grow_array(idx->edge, &idx->max_edge, area_stack.at * 2 + 1, sizeof(int));
+    for (int i = 0; i < area_stack.at; i++) {
+        const area_t *a = &area_stack.area[i];
+        const block_t *b = &frame.block[a->block];
+        if ((b->mon != mon && b->mon != &mirror) || a->active || a->begin >= a->end)
+            continue;
+        idx->edge[n++] = block_x(b, mon) + a->begin;
+        idx->edge[n++] = block_x(b, mon) + a->end;
+    }
+
+    idx->count = 0;
+    if (!n)
+        return;
+
+    qsort(idx->edge, n, sizeof(int), int_sort_cb);
+
+    // Drop the duplicates
+    int edges = 1;
+    for (int i = 1; i < n; i++) {
+        if (idx->edge[i] != idx->edge[edges - 1])
+            idx->edge[edges++] = idx->edge[i];
+    }
+    idx->count = edges - 1;
+
+    idx->hit = grow_array(idx->hit, &idx->max_hit, idx->count * AREA_BUTTONS, sizeof(int));
+    for (int i = 0; i < idx->count * AREA_BUTTONS; i++)
+        idx->hit[i] = -1;
+
+    // The areas are visited in the order they were opened, so that the innermost one wins
+    for (int i = 0; i < area_stack.at; i++) {
+        const area_t *a = &area_stack.area[i];
+        const block_t *b = &frame.block[a->block];
+        if ((b->mon != mon && b->mon != &mirror) || a->active || a->begin >= a->end)
+            continue;
+        const int x = block_x(b, mon);
+        for (int k = area_index_find(idx, x + a->begin); k >= 0 && k < idx->count && idx->edge[k] < x + a->end; k++)
+            idx->hit[k * AREA_BUTTONS + a->button - 1] = i;
+    }
+}
+
+area_t *
+area_get (xcb_window_t win, const int btn, const int x)
+{
+    if (btn < 1 || btn > AREA_BUTTONS)
+        return NULL;
+
+    for (monitor_t *mon = monhead; mon; mon = mon->next) {
+        if (mon->window != win)
+            continue;
+
+        const int k = area_index_find(&mon->areas, x);
+        if (k < 0 || mon->areas.hit[k * AREA_BUTTONS + btn - 1] < 0)
+            return NULL;
+
+        return &area_stack.area[mon->areas.hit[k * AREA_BUTTONS + btn - 1]];
+    }
+
+    return NULL;
+}
+
+bool
+area_add (char *str, const char *optend, char **end, const int block, const int button)
+{
+    int i;
+    char *trail;
+    area_t *a;
+
+    // A wild close area tag appeared!
+    if (*str != ':') {
+        *end = str;
+
+        // Find most recent unclosed area.
+        for (i = area_stack.at - 1; i >= area_stack.floor && !area_stack.area[i].active; i--)
+            ;
+
+        // Basic safety checks, the area must be closed within the same block it was opened in
+        if (i < area_stack.floor || area_stack.area[i].block != block) {
+            fprintf(stderr, "Invalid geometry for the clickable area\n");
+            return false;
+        }
+
+        // The coordinates are relative to the block start
+        a = &area_stack.area[i];
+        a->end = frame.block[block].width;
+        a->active = false;
+        return true;
+    }
+
+    // Found the closing : and check if it's just an escaped one
+    for (trail = strchr(++str, ':'); trail && trail[-1] == '\\'; trail = strchr(trail + 1, ':'))
+        ;
+
+    // Find the trailing : and make sure it's within the formatting block, also reject empty commands
+    if (!trail || str == trail || trail > optend) {
+        *end = str;
+        return false;
+    }
+
+    area_stack.area = grow_array(area_stack.area, &area_stack.max, area_stack.at + 1, sizeof(area_t));
+    a = &area_stack.area[area_stack.at++];
+
+    // The input line is left untouched, the command is copied in the string pool while unescaping
+    // all the :
+    area_stack.str = grow_array(area_stack.str, &area_stack.str_max, area_stack.str_len + (trail - str) + 1, 1);
+    a->cmd = area_stack.str_len;
+    for (char *needle = str; needle < trail; needle++) {
+        if (needle[0] == '\\' && needle[1] == ':')
+            continue;
+        area_stack.str[area_stack.str_len++] = *needle;
+    }
+    area_stack.str[area_stack.str_len++] = '\0';
+
+    a->active = true;
+    a->block = block;
+    a->begin = frame.block[block].width;
+    a->button = button;
+
+    *end = trail + 1;
+
+    return true;
+}
+
+bool
+font_resolve (font_t *font)
+{
+    xcb_query_font_reply_t *font_info = NULL;
+    xcb_generic_error_t *err = NULL, *query_err = NULL;
+
+    if (!font->pattern)
+        return font->ptr || font->xft_ft;
+
+    // The query fails along with the open, the check doesn't need another round trip then
+    if (font->ptr) {
+        font_info = xcb_query_font_reply(c, font->query_cookie, &query_err);
+        err = xcb_request_check(c, font->open_cookie);
+        free(query_err);
+    }
+
+    if (font_info && !err) {
+        font->descent = font_info->font_descent;
+        font->height = font_info->font_ascent + font_info->font_descent;
+        font->width = font_info->max_bounds.character_width;
+        font->char_max = font_info->max_byte1 << 8 | font_info->max_char_or_byte2;
+        font->char_min = font_info->min_byte1 << 8 | font_info->min_char_or_byte2;
+        // Copy over the width lut as it's part of font_info
+        int lut_size = sizeof(xcb_charinfo_t) * xcb_query_font_char_infos_length(font_info);
         if (lut_size) {
-            ret->width_lut = malloc(lut_size);
-            memcpy(ret->width_lut, xcb_query_font_char_infos(font_info), lut_size);
-        }
-        free(font_info);
-    } else if ((ret->xft_ft = XftFontOpenName (dpy, scr_nbr, pattern))) {
-        ret->ptr = 0;
-        ret->ascent = ret->xft_ft->ascent;
-        ret->descent = ret->xft_ft->descent;
-        ret->height = ret->ascent + ret->descent;
+            font->width_lut = malloc(lut_size);
+            memcpy(font->width_lut, xcb_query_font_char_infos(font_info), lut_size);
+        }
+    } else if ((font->xft_ft = XftFontOpenName (dpy, scr_nbr, font->pattern))) {
+        font->ptr = 0;
+        font->ascent = font->xft_ft->ascent;
+        font->descent = font->xft_ft->descent;
+        font->height = font->ascent + font->descent;
+        xft_fill_widths(font);
     } else {
-        fprintf(stderr, "Could not load font %s\n", pattern);
-        free(ret);
-        return;
+        fprintf(stderr, "Could not load font %s\n", font->pattern);
+        font->ptr = 0;
     }
 
-    font_list[font_count++] = ret;
+    free(font_info);
+    free(err);
+    free(font->pattern);
+    font->pattern = NULL;
+
+    // The bar height is settled by the first font, the fallbacks are aligned as if they were as tall
+    if (font != font_list[0] && font_list[0] && !font_list[0]->pattern)
+        font->height = font_list[0]->height;
+
+    return font->ptr || font->xft_ft;
 }
 
-void add_y_offset(int offset) {
-    if (offset_y_count >= MAX_FONT_COUNT) {
-        fprintf(stderr, "Max offset count reached. Could not set offset \"%d\"\n", offset);
-        return;
+bool
+font_has_glyph (font_t *font, const uint32_t c)
+{
+    if (!font_resolve(font))
+        return false;
+
+    if (font->xft_ft) {
+        if (XftCharExists(dpy, font->xft_ft, (FcChar32) c)) {
+            return true;
+        } else {
+            return false;
+        }
+
     }
 
-    offsets_y[offset_y_count] = strtol(optarg, NULL, 10);
-    if (offset_y_count == 0) {
-        for (int i = 1; i < MAX_FONT_COUNT; ++i) {
-            offsets_y[i] = offsets_y[0];
+    if (c < font->char_min || c > font->char_max)
+        return false;
+
+    if (font->width_lut && font->width_lut[c - font->char_min].character_width == 0)
+        return false;
+
+    return true;
+}
+
+bool
+font_covers (int *mask, const int i, const uint32_t c)
+{
+    if (!(*mask & COVERAGE_KNOWN(i))) {
+        *mask |= COVERAGE_KNOWN(i);
+        if (font_has_glyph(font_list[i], c))
+            *mask |= 1 << i;
+    }
+
+    return *mask & 1 << i;
+}
+
+void
+coverage_reset (void)
+{
+    memset(dense_coverage, 0, sizeof(dense_coverage));
+    cp_map_free(&coverage_map);
+}
+
+font_t *
+select_drawable_font (const uint32_t c)
+{
+    font_t *ret = NULL;
+    int mask = 0, known;
+
+    if (c < DENSE_WIDTHS)
+        mask = dense_coverage[c];
+    else
+        (void)cp_map_get(&coverage_map, c, &mask);
+    known = mask;
+
+    // If the user has specified a font to use, try that first.
+    if (font_index != -1 && font_covers(&mask, font_index - 1, c)) {
+        offset_y_index = font_index - 1;
+        ret = font_list[font_index - 1];
+    }
+
+    // If the end is reached without finding an appropriate font, return NULL.
+    // If the font can draw the character, return it.
+    for (int i = 0; !ret && i < font_count; i++) {
+        if (font_covers(&mask, i, c)) {
+            offset_y_index = i;
+            ret = font_list[i];
         }
     }
-    ++offset_y_count;
+
+    if (mask != known) {
+        if (c < DENSE_WIDTHS)
+            dense_coverage[c] = mask;
+        else
+            cp_map_put(&coverage_map, c, mask);
+    }
+
+    return ret;
 }
 
+int
+block_new (monitor_t *mon, const int align)
+{
+    frame.block = grow_array(frame.block, &frame.max_blocks, frame.blocks + 1, sizeof(block_t));
 
-enum {
-    NET_WM_WINDOW_TYPE,
-    NET_WM_WINDOW_TYPE_DOCK,
-    NET_WM_DESKTOP,
-    NET_WM_STRUT_PARTIAL,
-    NET_WM_STRUT,
-    NET_WM_STATE,
-    NET_WM_STATE_STICKY,
-    NET_WM_STATE_ABOVE,
-};
+    frame.block[frame.blocks] = (block_t){ .mon = mon, .align = align };
+
+    return frame.blocks++;
+}
+
+monitor_t *
+mirror_get (void)
+{
+    if (mirror.pixmap)
+        return &mirror;
+
+    for (monitor_t *m = monhead; m; m = m->next)
+        mirror.width = max(mirror.width, m->width);
+
+    const int depth = (visual == scr->root_visual) ? XCB_COPY_FROM_PARENT : 32;
+    mirror.pixmap = xcb_generate_id(c);
+    xcb_create_pixmap(c, depth, mirror.pixmap, monhead->window, mirror.width, bh);
+    mirror.picture = XRenderCreatePicture(dpy, mirror.pixmap, pict_format, 0, NULL);
 
+    return &mirror;
+}
+
+// Drop the mirror, it's set up again at the right size the next time it's needed
 void
-set_ewmh_atoms (void)
+mirror_reset (void)
 {
-    const char *atom_names[] = {
-        "_NET_WM_WINDOW_TYPE",
-        "_NET_WM_WINDOW_TYPE_DOCK",
-        "_NET_WM_DESKTOP",
-        "_NET_WM_STRUT_PARTIAL",
-        "_NET_WM_STRUT",
-        "_NET_WM_STATE",
-        // Leave those at the end since are batch-set
-        "_NET_WM_STATE_STICKY",
-        "_NET_WM_STATE_ABOVE",
+    if (!mirror.pixmap)
+        return;
+
+    XRenderFreePicture(dpy, mirror.picture);
+    xcb_free_pixmap(c, mirror.pixmap);
+    free(mirror.damage);
+    mirror = (monitor_t){ 0 };
+}
+
+int
+run_new (const int block, font_t *font)
+{
+    frame.run = grow_array(frame.run, &frame.max_runs, frame.runs + 1, sizeof(run_t));
+
+    frame.run[frame.runs] = (run_t){
+        .block = block,
+        .x = frame.block[block].width,
+        .font = font,
+        .offset_y = offsets_y[offset_y_index],
+        .attrs = attrs,
+        .fg = fgc,
+        .bg = bgc,
+        .bg_stop = bgc_stop,
+        .ug = ugc,
+        .glyph = frame.glyphs,
     };
-    const int atoms = sizeof(atom_names)/sizeof(char *);
-    xcb_intern_atom_cookie_t atom_cookie[atoms];
-    xcb_atom_t atom_list[atoms];
-    xcb_intern_atom_reply_t *atom_reply;
 
-    // As suggested fetch all the cookies first (yum!) and then retrieve the
-    // atoms to exploit the async'ness
-    for (int i = 0; i < atoms; i++)
-        atom_cookie[i] = xcb_intern_atom(c, 0, strlen(atom_names[i]), atom_names[i]);
+    return frame.runs++;
+}
+
+// Returns the length of the run of plain ASCII characters at the start of str. The run stops at
+// any byte that needs a closer look: the start of a multibyte sequence, a % that may open a
+// formatting block and the end of the line.
+size_t
+ascii_span (const char *str)
+{
+#if defined(__AVX2__) || defined(__SSE2__)
+    // The loads are aligned so that they never cross a page boundary, it's then safe to read past
+    // the terminator. The bytes before str are masked off.
+#if defined(__AVX2__)
+    const uintptr_t off = (uintptr_t)str & 31;
+    const char *base = str - off;
+    const __m256i pct = _mm256_set1_epi8('%'), nl = _mm256_set1_epi8('\n'), nul = _mm256_setzero_si256();
+    uint32_t mask = ~0u << off;
+
+    for (;; base += 32, mask = ~0u) {
+        const __m256i v = _mm256_load_si256((const __m256i *)base);
+        const __m256i special = _mm256_or_si256(_mm256_or_si256(v,
+                    _mm256_cmpeq_epi8(v, pct)), _mm256_or_si256(_mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(v, nul)));
+
+        // The high bit is set for the non-ASCII bytes and for the matches
+        mask &= (uint32_t)_mm256_movemask_epi8(special);
+        if (mask)
+            return base + __builtin_ctz(mask) - str;
+    }
+#else
+    const uintptr_t off = (uintptr_t)str & 15;
+    const char *base = str - off;
+    const __m128i pct = _mm_set1_epi8('%'), nl = _mm_set1_epi8('\n'), nul = _mm_setzero_si128();
+    uint32_t mask = 0xffffu << off;
+
+    for (;; base += 16, mask = 0xffffu) {
+        const __m128i v = _mm_load_si128((const __m128i *)base);
+        const __m128i special = _mm_or_si128(_mm_or_si128(v,
+                    _mm_cmpeq_epi8(v, pct)), _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, nul)));
+
+        // The high bit is set for the non-ASCII bytes and for the matches
+        mask &= (uint32_t)_mm_movemask_epi8(special);
+        if (mask)
+            return base + __builtin_ctz(mask) - str;
+    }
+#endif
+#else
+    const char *p = str;
+
+    while ((uint8_t)*p < 0x80 && *p != '%' && *p != '\n' && *p != '\0')
+        p++;
+
+    return p - str;
+#endif
+}
+
+// Decode the utf-8 sequence at *str and move past it. Overlong sequences, surrogates and values
+// past U+10FFFF are replaced by U+FFFD, as are the truncated sequences (whose first byte only is
+// skipped). A stray continuation byte is taken as a latin-1 character.
+uint32_t
+utf8_decode (char **str)
+{
+    const uint8_t *utf = (const uint8_t *)*str;
+    static const uint32_t min_cp[] = { 0, 0, 0x80, 0x800, 0x10000, 0x200000, 0x4000000 };
+    uint32_t ucs;
+    int len;
+
+    if (utf[0] < 0x80) {
+        *str += 1;
+        return utf[0];
+    }
+
+    if ((utf[0] & 0xe0) == 0xc0)
+        { ucs = utf[0] & 0x1f; len = 2; }
+    else if ((utf[0] & 0xf0) == 0xe0)
+        { ucs = utf[0] & 0x0f; len = 3; }
+    else if ((utf[0] & 0xf8) == 0xf0)
+        { ucs = utf[0] & 0x07; len = 4; }
+    else if ((utf[0] & 0xfc) == 0xf8)
+        { ucs = utf[0] & 0x03; len = 5; }
+    else if ((utf[0] & 0xfe) == 0xfc)
+        { ucs = utf[0] & 0x01; len = 6; }
+    else {
+        // Not a valid utf-8 sequence
+        *str += 1;
+        return utf[0];
+    }
+
+    for (int i = 1; i < len; i++) {
+        // This also stops at the terminator
+        if ((utf[i] & 0xc0) != 0x80) {
+            *str += 1;
+            return 0xfffd;
+        }
+        ucs = ucs << 6 | (utf[i] & 0x3f);
+    }
+
+    *str += len;
+
+    if (ucs < min_cp[len] || ucs > 0x10ffff || (ucs >= 0xd800 && ucs <= 0xdfff))
+        return 0xfffd;
+
+    return ucs;
+}
+
+void
+glyph_add (const int block, int *cur_run, const uint32_t ucs)
+{
+    font_t *cur_font = select_drawable_font(ucs);
+
+    if (!cur_font)
+        return;
+
+    // Glyphs are accumulated until the font changes
+    if (*cur_run < 0 || frame.run[*cur_run].font != cur_font || frame.run[*cur_run].len == MAX_RUN_LEN)
+        *cur_run = run_new(block, cur_font);
+
+    frame.glyph = grow_array(frame.glyph, &frame.max_glyphs, frame.glyphs + 1, sizeof(uint32_t));
+    frame.glyph[frame.glyphs++] = ucs;
+
+    const int w = char_width(cur_font, ucs);
+    frame.run[*cur_run].len++;
+    frame.run[*cur_run].width += w;
+    frame.block[block].width += w;
+}
+
+void
+parse_begin (parse_state_t *st)
+{
+    // Reset the stack position
+    area_stack.at = 0;
+    area_stack.str_len = 0;
+
+    // The previous frame is kept around, only what differs from it is drawn
+    const frame_t swap = last_frame;
+    last_frame = frame;
+    frame = swap;
+
+    // Start from an empty frame
+    frame.blocks = frame.runs = frame.glyphs = 0;
+    frame.clear = bgc;
+
+    st->align = ALIGN_L;
+    st->mon = monhead;
+    st->block = block_new(st->mon, st->align);
+}
+
+void
+parse_save (const parse_state_t *st, parse_state_t *out)
+{
+    *out = (parse_state_t){
+        .mon = st->mon,
+        .block = st->block,
+        .align = st->align,
+        .blocks = frame.blocks,
+        .runs = frame.runs,
+        .glyphs = frame.glyphs,
+        .block_width = frame.block[st->block].width,
+        .areas = area_stack.at,
+        .area_str = area_stack.str_len,
+        .fg = fgc,
+        .bg = bgc,
+        .bg_stop = bgc_stop,
+        .ug = ugc,
+        .attrs = attrs,
+        .font_index = font_index,
+        .offset_y_index = offset_y_index,
+    };
+
+    for (int i = 0; i < area_stack.at; i++)
+        out->area_open |= area_stack.area[i].active;
+}
+
+void
+style_restore (const parse_state_t *in)
+{
+    fgc = in->fg;
+    bgc = in->bg;
+    bgc_stop = in->bg_stop;
+    ugc = in->ug;
+    attrs = in->attrs;
+    font_index = in->font_index;
+    offset_y_index = in->offset_y_index;
+}
+
+// Drop what was parsed after the state was saved, the frame must hold what it held back then
+void
+parse_restore (parse_state_t *st, const parse_state_t *in)
+{
+    *st = *in;
+
+    frame.blocks = in->blocks;
+    frame.runs = in->runs;
+    frame.glyphs = in->glyphs;
+    frame.block[in->block].width = in->block_width;
+
+    area_stack.at = in->areas;
+    area_stack.str_len = in->area_str;
+
+    style_restore(in);
+}
+
+// A region is done, what it left open or changed doesn't leak into the text following it. The
+// areas it didn't close end where the region does.
+void
+parse_leave (parse_state_t *st, const parse_state_t *in)
+{
+    for (int i = in->areas; i < area_stack.at; i++) {
+        area_t *a = &area_stack.area[i];
+        if (a->active) {
+            a->end = frame.block[a->block].width;
+            a->active = false;
+        }
+    }
+    area_stack.floor = 0;
+
+    st->mon = in->mon;
+    st->block = in->block;
+    st->align = in->align;
+
+    style_restore(in);
+}
+
+// Parse text where the parser stands, returns false if it's so broken the rest can't be parsed
+bool
+parse_text (parse_state_t *st, char *text)
+{
+    monitor_t *cur_mon = st->mon;
+    int cur_block = st->block, cur_run = -1, align = st->align, button;
+    char *p = text, *block_end, *ep;
+    rgba_t tmp;
+
+    for (;;) {
+        if (*p == '\0' || *p == '\n')
+			break;
+
+        if (p[0] == '%' && p[1] == '{' && (block_end = strchr(p++, '}'))) {
+            // Any formatting block may change the style, the following glyphs start a new run
+            cur_run = -1;
+
+            p++;
+            while (p < block_end) {
+                int w;
+                while (isspace(*p))
+                    p++;
+
+                switch (*p++) {
+                    case '+': set_attribute('+', *p++); break;
+                    case '-': set_attribute('-', *p++); break;
+                    case '!': set_attribute('!', *p++); break;
+
+                    case 'R':
+                              tmp = fgc;
+                              fgc = bgc;
+                              bgc = bgc_stop = tmp;
+                              break;
+
+                    case 'l': align = ALIGN_L; cur_block = block_new(cur_mon, align); break;
+                    case 'c': align = ALIGN_C; cur_block = block_new(cur_mon, align); break;
+                    case 'r': align = ALIGN_R; cur_block = block_new(cur_mon, align); break;
+
+                    case 'A':
+                              button = XCB_BUTTON_INDEX_1;
+                              // The range is 1-5
+                              if (isdigit(*p) && (*p > '0' && *p < '6'))
+                                  button = *p++ - '0';
+                              if (!area_add(p, block_end, &p, cur_block, button))
+                                  return false;
+                              break;
+
+                    case 'B': bgc = bgc_stop = parse_color(p, &p, dbgc); break;
+                    case 'G':
+                              bgc = parse_color(p, &p, dbgc);
+                              bgc_stop = (*p == '#') ? parse_color(p, &p, bgc) : bgc;
+                              break;
+                    case 'F': fgc = parse_color(p, &p, dfgc); break;
+                    case 'U': ugc = parse_color(p, &p, dugc); break;
+
+                    case 'S':
+                              // The mirror has no neighbours, stepping from it starts over
+                              if (cur_mon == &mirror && (*p == '+' || *p == '-'))
+                              { cur_mon = (*p == '+' || !montail) ? monhead : montail; }
+                              else if (*p == '+' && cur_mon->next)
+                              { cur_mon = cur_mon->next; }
+                              else if (*p == '-' && cur_mon->prev)
+                              { cur_mon = cur_mon->prev; }
+                              else if (*p == 'f')
+                              { cur_mon = monhead; }
+                              else if (*p == 'l')
+                              { cur_mon = montail ? montail : monhead; }
+                              else if (*p == '*')
+                              { cur_mon = mirror_get(); }
+                              else if (isdigit(*p))
+                              { cur_mon = monhead;
+                                for (int i = 0; i != *p-'0' && cur_mon->next; i++)
+                                    cur_mon = cur_mon->next;
+                              }
+                              else
+                              { p++; continue; }
+
+                              p++;
+                              cur_block = block_new(cur_mon, align);
+                              break;
+                    case 'O':
+                              errno = 0;
+                              w = (int) strtoul(p, &p, 10);
+                              if (errno)
+                                  continue;
+
+                              frame.run[run_new(cur_block, NULL)].width = w;
+                              frame.block[cur_block].width += w;
+                              break;
+
+                    case 'T':
+                              if (*p == '-') { //Reset to automatic font selection
+                                  font_index = -1;
+                                  p++;
+                                  break;
+                              } else if (isdigit(*p)) {
+                                  font_index = (int)strtoul(p, &ep, 10);
+                                  // User-specified 'font_index' ∊ (0,font_count]
+                                  // Otherwise just fallback to the automatic font selection
+                                  if (!font_index || font_index > font_count)
+                                  font_index = -1;
+                                  p = ep;
+                                  break;
+                              } else {
+                                  fprintf(stderr, "Invalid font slot \"%c\"\n", *p++); //Swallow the token
+                                  break;
+                              }
+
+                    // In case of error keep parsing after the closing }
+                    default:
+                        p = block_end;
+                }
+            }
+            // Eat the trailing }
+            p++;
+        } else {
+            // Plain ASCII is the common case, it needs no decoding and is found in bulk
+            const size_t n = ascii_span(p);
+
+            if (n) {
+                for (size_t i = 0; i < n; i++)
+                    glyph_add(cur_block, &cur_run, (uint8_t)p[i]);
+                p += n;
+            } else {
+                glyph_add(cur_block, &cur_run, utf8_decode(&p));
+            }
+        }
+    }
+
+    st->mon = cur_mon;
+    st->block = cur_block;
+    st->align = align;
+
+    return true;
+}
+
+// Returns the index the region called name has or would have, the regions are sorted by name
+int
+region_search (const char *name)
+{
+    int lo = 0, hi = regions;
+
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (strcmp(region[mid].name, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+bool
+region_exists (const char *name)
+{
+    const int i = region_search(name);
+    return i < regions && !strcmp(region[i].name, name);
+}
+
+// Returns the index of the region called name, it's created if it doesn't exist yet. Returns -1
+// if there are too many regions already.
+int
+region_get (const char *name)
+{
+    const int lo = region_search(name);
+
+    if (lo == regions || strcmp(region[lo].name, name)) {
+        if (regions == MAX_REGIONS) {
+            fprintf(stderr, "Too many regions, \"%s\" is ignored\n", name);
+            return -1;
+        }
+
+        region = grow_array(region, &max_regions, regions + 1, sizeof(region_t));
+        memmove(region + lo + 1, region + lo, (regions - lo) * sizeof(region_t));
+        region[lo] = (region_t){ .name = strdup(name), .text = strdup(""), .piece = -1 };
+        regions++;
+
+        if (!region[lo].name || !region[lo].text) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // The indices past this one have moved
+        pieces_stale = true;
+    }
+
+    return lo;
+}
+
+void
+region_set (const int i, const char *text)
+{
+    if (!strcmp(region[i].text, text))
+        return;
+
+    free(region[i].text);
+    region[i].text = strdup(text);
+
+    if (!region[i].text) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Only what comes after the region has to be parsed again, a region that isn't drawn doesn't
+    // need anything
+    if (region[i].piece >= 0)
+        dirty_piece = min(dirty_piece, region[i].piece);
+}
+
+void
+region_update (char *line)
+{
+    char *name, *text;
+
+    if (line[0] != '@' || !line[1] || line[1] == ' ') {
+        fprintf(stderr, "Expected a line in the form \"@name text\"\n");
+        return;
+    }
+
+    name = line + 1;
+    text = strchr(name, ' ');
+    if (text)
+        *text++ = '\0';
+
+    const int i = region_get(name);
+    if (i >= 0)
+        region_set(i, text ? text : "");
+}
+
+void
+line_piece_add (const int text, const int name)
+{
+    line_piece = grow_array(line_piece, &max_line_pieces, line_pieces + 1, sizeof(piece_t));
+    line_piece[line_pieces++] = (piece_t){ .text = text, .name = name, .region = -1 };
+}
+
+// Cut the standard input line in place at the %{N:name}...%{N} blocks, the content of each block
+// goes to its region. An empty block leaves the region content alone, the region can then be
+// filled by "@name text" lines only.
+void
+line_set (char *line)
+{
+    char *p, *text;
+
+    line_pieces = 0;
+
+    for (p = text = line; (p = strstr(p, "%{N:")); ) {
+        char *name = p + 4;
+        char *name_end = strchr(name, '}');
+        char *close = name_end ? strstr(name_end + 1, "%{N}") : NULL;
+
+        // Not a region, the parser skips the malformed block
+        if (!close || name_end == name) {
+            p = name;
+            continue;
+        }
+
+        *name_end = '\0';
+        const int i = region_get(name);
+        // Out of regions, the parser skips the block and draws its content as plain text
+        if (i < 0) {
+            *name_end = '}';
+            p = name;
+            continue;
+        }
+
+        *p = *close = '\0';
+        line_piece_add(text - line, -1);
+        line_piece_add(-1, name - line);
+
+        if (name_end[1])
+            region_set(i, name_end + 1);
+
+        p = text = close + 4;
+    }
+    line_piece_add(text - line, -1);
+
+    pieces_stale = true;
+}
+
+// Cut the newest standard input line if it's not been yet, the reader keeps it until a newer one
+// comes
+void
+input_flush (void)
+{
+    if (!input_fresh)
+        return;
+
+    line_set(input.buf + input.line);
+    input_fresh = false;
+}
+
+// Handle a line from the standard input, the updates are told apart from the lines to draw by the
+// leading @ followed by the name of a known region, any other line is drawn as is. Returns true
+// for a line to draw, it's kept by the reader.
+bool
+input_line (char *line)
+{
+    if (line[0] == '@' && line[1] && line[1] != ' ') {
+        // The region content the pending line carries is older than the update, and it may
+        // place the region first
+        input_flush();
+
+        char *name_end = strchr(line + 1, ' ');
+        if (name_end)
+            *name_end = '\0';
+        const bool known = region_exists(line + 1);
+        if (name_end)
+            *name_end = ' ';
+
+        if (known) {
+            region_update(line);
+            return false;
+        }
+    }
+
+    if (input_fresh)
+        stats.skipped++;
+    input_fresh = true;
+    return true;
+}
+
+void
+piece_add (const int text, const int r)
+{
+    piece = grow_array(piece, &max_pieces, pieces + 1, sizeof(piece_t));
+    piece[pieces] = (piece_t){ .text = text, .region = r };
+
+    if (r >= 0 && region[r].piece < 0)
+        region[r].piece = pieces;
+
+    pieces++;
+}
+
+void
+pieces_build (void)
+{
+    pieces = 0;
+    for (int i = 0; i < regions; i++)
+        region[i].piece = -1;
+
+    // The regions named by the line exist, line_set created them
+    for (int i = 0; i < line_pieces; i++) {
+        const int name = line_piece[i].name;
+        piece_add(line_piece[i].text, name >= 0 ? region_search(input.buf + input.line + name) : -1);
+    }
+
+    pieces_stale = false;
+}
+
+void
+frame_copy (frame_t *dst, const frame_t *src)
+{
+    dst->clear = src->clear;
+
+    dst->block = grow_array(dst->block, &dst->max_blocks, src->blocks, sizeof(block_t));
+    memcpy(dst->block, src->block, src->blocks * sizeof(block_t));
+    dst->blocks = src->blocks;
+
+    dst->run = grow_array(dst->run, &dst->max_runs, src->runs, sizeof(run_t));
+    memcpy(dst->run, src->run, src->runs * sizeof(run_t));
+    dst->runs = src->runs;
+
+    dst->glyph = grow_array(dst->glyph, &dst->max_glyphs, src->glyphs, sizeof(uint32_t));
+    memcpy(dst->glyph, src->glyph, src->glyphs * sizeof(uint32_t));
+    dst->glyphs = src->glyphs;
+}
+
+void
+parse_document (void)
+{
+    parse_state_t st;
+    int from = 0;
+
+    // A new line or new regions, the saved states aren't valid anymore
+    const bool rebuild = pieces_stale;
+    if (rebuild)
+        pieces_build();
+
+    // When only some regions changed the frame is kept up to the first of them and the rest is
+    // parsed again, the blocks that don't follow it keep their layout
+    if (!rebuild && !full_redraw && (dirty_piece >= pieces || !piece[dirty_piece].state.area_open)) {
+        frame_copy(&last_frame, &frame);
+        from = min(dirty_piece, pieces);
+        if (from < pieces)
+            parse_restore(&st, &piece[from].state);
+    } else {
+        parse_begin(&st);
+    }
+    dirty_piece = INT_MAX;
+
+    for (int i = from; i < pieces; i++) {
+        // A region is parsed on its own, starting from the style of the text before it and
+        // leaving it as it was. A broken region only loses its own content.
+        if (piece[i].region >= 0) {
+            parse_save(&st, &piece[i].state);
+            area_stack.floor = area_stack.at;
+            parse_text(&st, region[piece[i].region].text);
+            parse_leave(&st, &piece[i].state);
+            continue;
+        }
+
+        if (!parse_text(&st, input.buf + input.line + piece[i].text)) {
+            // The states of the pieces left weren't saved
+            pieces_stale = true;
+            break;
+        }
+    }
+}
+
+void
+frame_layout (void)
+{
+    // Now that the width of every block is known each one can be placed
+    for (int i = 0; i < frame.blocks; i++) {
+        block_t *b = &frame.block[i];
+
+        switch (b->align) {
+            case ALIGN_L:
+                b->x = 0;
+                break;
+            case ALIGN_C:
+                b->x = b->mon->width / 2 - b->width / 2;
+                break;
+            case ALIGN_R:
+                b->x = b->mon->width - b->width;
+                break;
+        }
+    }
+}
+
+void
+damage_add (monitor_t *mon, int x, int width)
+{
+    int x0 = max(x, 0), x1 = min(x + width, mon->width);
+    int i, j;
+
+    if (x0 >= x1)
+        return;
+
+    // Find the rectangles touching the new one and merge them all together
+    for (i = 0; i < mon->damage_count && mon->damage[i].x + mon->damage[i].width < x0; i++)
+        ;
+    for (j = i; j < mon->damage_count && mon->damage[j].x <= x1; j++) {
+        x0 = min(x0, mon->damage[j].x);
+        x1 = max(x1, mon->damage[j].x + mon->damage[j].width);
+    }
+
+    if (i == j) {
+        mon->damage = grow_array(mon->damage, &mon->damage_max, mon->damage_count + 1, sizeof(xcb_rectangle_t));
+        memmove(&mon->damage[i + 1], &mon->damage[i], (mon->damage_count - i) * sizeof(xcb_rectangle_t));
+        mon->damage_count++;
+    } else if (j > i + 1) {
+        memmove(&mon->damage[i + 1], &mon->damage[j], (mon->damage_count - j) * sizeof(xcb_rectangle_t));
+        mon->damage_count -= j - i - 1;
+    }
+
+    mon->damage[i] = (xcb_rectangle_t){ x0, 0, x1 - x0, bh };
+}
+
+bool
+damage_hits (const monitor_t *mon, int x, int width)
+{
+    for (int i = 0; i < mon->damage_count; i++) {
+        const xcb_rectangle_t *d = &mon->damage[i];
+        if (x < d->x + d->width && d->x < x + width)
+            return true;
+    }
+    return false;
+}
+
+bool
+run_equal (const frame_t *fa, const run_t *a, const frame_t *fb, const run_t *b)
+{
+    const block_t *ba = &fa->block[a->block];
+    const block_t *bb = &fb->block[b->block];
+
+    return ba->mon == bb->mon && ba->x + a->x == bb->x + b->x && a->width == b->width &&
+           a->font == b->font && a->offset_y == b->offset_y && a->attrs == b->attrs &&
+           a->fg.v == b->fg.v && a->bg.v == b->bg.v && a->bg_stop.v == b->bg_stop.v && a->ug.v == b->ug.v && a->len == b->len &&
+           (!a->len || !memcmp(&fa->glyph[a->glyph], &fb->glyph[b->glyph], a->len * sizeof(uint32_t)));
+}
+
+// The damaged regions are cleared before drawing, the runs overlapping them have to be redrawn too
+// and so on
+void
+damage_spread (void)
+{
+    bool changed;
+
+    do {
+        changed = false;
+        for (int i = 0; i < frame.runs; i++) {
+            run_t *r = &frame.run[i];
+            const block_t *b = &frame.block[r->block];
+            if (!r->dirty && damage_hits(b->mon, b->x + r->x, r->width)) {
+                r->dirty = true;
+                damage_add(b->mon, b->x + r->x, r->width);
+                changed = true;
+            }
+        }
+    } while (changed);
+}
+
+void
+mirror_damage (const frame_t *f)
+{
+    for (int i = 0; i < f->blocks; i++) {
+        const block_t *b = &f->block[i];
+
+        if (b->mon != &mirror)
+            continue;
+
+        for (int k = 0; k < mirror.damage_count; k++) {
+            const xcb_rectangle_t *d = &mirror.damage[k];
+            const int x0 = max(d->x, b->x);
+            const int x1 = min(d->x + d->width, b->x + b->width);
+
+            if (x0 >= x1)
+                continue;
+            for (monitor_t *m = monhead; m; m = m->next)
+                damage_add(m, block_x(b, m) + x0 - b->x, x1 - x0);
+        }
+    }
+}
+
+void
+frame_diff (void)
+{
+    int last = -1;
+
+    for (int i = 0; i < frame.runs; i++)
+        frame.run[i].dirty = true;
+
+    if (full_redraw || frame.clear.v != last_frame.clear.v) {
+        for (monitor_t *m = monhead; m != NULL; m = m->next)
+            damage_add(m, 0, m->width);
+        if (mirror.pixmap)
+            damage_add(&mirror, 0, mirror.width);
+        full_redraw = false;
+        return;
+    }
+
+    // Pair every run with an identical one in the previous frame, the pairs must preserve the
+    // drawing order or the overlapping parts could differ
+    for (int i = 0; i < last_frame.runs; i++)
+        last_frame.run[i].dirty = true;
+
+    for (int i = 0; i < frame.runs; i++) {
+        for (int j = last + 1; j < last_frame.runs; j++) {
+            if (run_equal(&frame, &frame.run[i], &last_frame, &last_frame.run[j])) {
+                frame.run[i].dirty = last_frame.run[j].dirty = false;
+                last = j;
+                break;
+            }
+        }
+    }
+
+    // What's gone has to be cleared and what's new has to be drawn
+    for (int i = 0; i < last_frame.runs; i++) {
+        const run_t *r = &last_frame.run[i];
+        const block_t *b = &last_frame.block[r->block];
+        if (r->dirty)
+            damage_add(b->mon, b->x + r->x, r->width);
+    }
+    for (int i = 0; i < frame.runs; i++) {
+        const run_t *r = &frame.run[i];
+        const block_t *b = &frame.block[r->block];
+        if (r->dirty)
+            damage_add(b->mon, b->x + r->x, r->width);
+    }
+
+    damage_spread();
+
+    // What changed in the mirror changed on every monitor, where the mirrored blocks are now and
+    // where they were
+    if (mirror.damage_count) {
+        mirror_damage(&last_frame);
+        mirror_damage(&frame);
+        damage_spread();
+    }
+}
+
+void
+frame_draw (void)
+{
+#if WITH_PRESENT
+    for (monitor_t *m = monhead; m != NULL; m = m->next) {
+        if (m->buffer[1] && m->damage_count)
+            present_begin(m);
+    }
+#endif
+
+    update_gc(GC_CLEAR, frame.clear);
+
+    if (mirror.damage_count)
+        xcb_poly_fill_rectangle(c, mirror.pixmap, gc[GC_CLEAR], mirror.damage_count, mirror.damage);
+
+    for (monitor_t *m = monhead; m != NULL; m = m->next) {
+#if WITH_SHM
+        if (m->shm_data) {
+            for (int i = 0; i < m->damage_count; i++)
+                shm_fill(m, m->damage[i].x, m->damage[i].y, m->damage[i].width, m->damage[i].height, frame.clear);
+            continue;
+        }
+#endif
+        if (m->damage_count)
+            xcb_poly_fill_rectangle(c, m->pixmap, gc[GC_CLEAR], m->damage_count, m->damage);
+    }
+
+    // Every run is drawn once at its final position
+    for (int i = 0; i < frame.runs; i++) {
+        const run_t *r = &frame.run[i];
+        const block_t *b = &frame.block[r->block];
+
+        if (!r->dirty)
+            continue;
+#if WITH_SHM
+        if (b->mon->shm_data) {
+            shm_draw_run(b->mon, b->x + r->x, r);
+            continue;
+        }
+#endif
+        draw_run(b->mon, b->x + r->x, r);
+    }
+
+#if WITH_SHM
+    for (monitor_t *m = monhead; m != NULL; m = m->next) {
+        if (m->shm_data)
+            shm_push(m);
+    }
+
+    // Now that the buffers are in place the server can draw the text the buffers can't hold
+    for (int i = 0; i < frame.runs; i++) {
+        const run_t *r = &frame.run[i];
+        const block_t *b = &frame.block[r->block];
+
+        if (r->dirty && b->mon->shm_data && shm_run_on_server(r))
+            draw_text(b->mon, b->x + r->x, r);
+    }
+#endif
+
+    // The mirrored blocks are copied on top of what's been drawn on each monitor
+    for (monitor_t *m = monhead; m != NULL && mirror.pixmap; m = m->next) {
+        for (int i = 0; i < frame.blocks; i++) {
+            const block_t *b = &frame.block[i];
+            const int x = block_x(b, m);
+
+            if (b->mon != &mirror)
+                continue;
+
+            for (int k = 0; k < m->damage_count; k++) {
+                const int x0 = max(m->damage[k].x, x);
+                const int x1 = min(m->damage[k].x + m->damage[k].width, x + b->width);
+
+                if (x0 < x1)
+                    xcb_copy_area(c, mirror.pixmap, m->pixmap, gc[GC_DRAW], b->x + x0 - x, 0, x0, 0, x1 - x0, bh);
+            }
+        }
+    }
+    mirror.damage_count = 0;
+}
+
+void
+parse (void)
+{
+    const int64_t start = now_us();
+
+    stats.frames++;
+
+    input_flush();
+
+    parse_document();
+    frame_layout();
+    for (monitor_t *mon = monhead; mon; mon = mon->next)
+        area_index_build(mon);
+    frame_diff();
+
+    const int64_t parsed = now_us();
+    histogram_add(&stats.parse_us, parsed - start);
+
+    frame_draw();
+    histogram_add(&stats.draw_us, now_us() - parsed);
+}
+
+void
+histogram_dump (FILE *f, const char *name, const histogram_t *h)
+{
+    fprintf(f, "%s count=%llu avg=%llu", name, (unsigned long long)h->count,
+            (unsigned long long)(h->count ? h->total / h->count : 0));
+
+    for (int i = 0; i < HIST_BUCKETS - 1; i++)
+        fprintf(f, " <%d:%u", 2 << i, h->bucket[i]);
+    fprintf(f, " more:%u\n", h->bucket[HIST_BUCKETS - 1]);
+}
+
+// The X requests sent so far. Every request gets the next sequence number, Xlib ones included, the
+// NoOperation sent to find it out isn't counted.
+uint64_t
+x_requests (void)
+{
+    return xcb_no_operation(c).sequence - ++stats.noops;
+}
+
+void
+stats_dump (FILE *f)
+{
+    const uint64_t requests = x_requests();
+
+    fprintf(f, "lines %llu\n", (unsigned long long)stats.lines);
+    fprintf(f, "frames %llu\n", (unsigned long long)stats.frames);
+    fprintf(f, "skipped %llu\n", (unsigned long long)stats.skipped);
+    fprintf(f, "requests %llu\n", (unsigned long long)requests);
+    fprintf(f, "runs %llu\n", (unsigned long long)stats.runs);
+    fprintf(f, "glyphs %llu\n", (unsigned long long)stats.glyphs);
+    fprintf(f, "width_hits %llu\n", (unsigned long long)stats.width_hits);
+    fprintf(f, "width_misses %llu\n", (unsigned long long)stats.width_misses);
+    fprintf(f, "gc_changes %llu\n", (unsigned long long)stats.gc_changes);
+    fprintf(f, "gc_skips %llu\n", (unsigned long long)stats.gc_skips);
+    fprintf(f, "fill_hits %llu\n", (unsigned long long)stats.fill_hits);
+    fprintf(f, "fill_misses %llu\n", (unsigned long long)stats.fill_misses);
+    fprintf(f, "clicks %llu\n", (unsigned long long)stats.clicks);
+    fprintf(f, "clicks_dropped %llu\n", (unsigned long long)stats.clicks_dropped);
+    histogram_dump(f, "parse_us", &stats.parse_us);
+    histogram_dump(f, "draw_us", &stats.draw_us);
+    fflush(f);
+}
+
+void
+stats_write (const char *path)
+{
+    FILE *f;
+    int fd;
+
+    // Don't wait for a reader if that's a fifo, just try again later
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK, 0644);
+    if (fd < 0)
+        return;
+
+    if (!(f = fdopen(fd, "w"))) {
+        close(fd);
+        return;
+    }
+
+    stats_dump(f);
+    fclose(f);
+}
+
+void
+font_load (const char *pattern)
+{
+    if (font_count >= MAX_FONT_COUNT) {
+        fprintf(stderr, "Max font count reached. Could not load font \"%s\"\n", pattern);
+        return;
+    }
+
+    font_t *ret = calloc(1, sizeof(font_t));
+
+    if (!ret)
+        return;
+
+    // Try it as a core font first, the replies are collected by font_resolve. This way the
+    // requests for all the fonts are in flight at the same time. A fontconfig pattern with
+    // properties can't be a core font name, it goes straight to Xft.
+    ret->pattern = strdup(pattern);
+    if (!strpbrk(pattern, ":=")) {
+        ret->ptr = xcb_generate_id(c);
+        ret->open_cookie = xcb_open_font_checked(c, ret->ptr, strlen(pattern), pattern);
+        ret->query_cookie = xcb_query_font(c, ret->ptr);
+    }
+
+    font_list[font_count++] = ret;
+    coverage_reset();
+}
+
+void add_y_offset(int offset) {
+    if (offset_y_count >= MAX_FONT_COUNT) {
+        fprintf(stderr, "Max offset count reached. Could not set offset \"%d\"\n", offset);
+        return;
+    }
+
+    offsets_y[offset_y_count] = strtol(optarg, NULL, 10);
+    if (offset_y_count == 0) {
+        for (int i = 1; i < MAX_FONT_COUNT; ++i) {
+            offsets_y[i] = offsets_y[0];
+        }
+    }
+    ++offset_y_count;
+}
+
+
+enum {
+    NET_WM_WINDOW_TYPE,
+    NET_WM_WINDOW_TYPE_DOCK,
+    NET_WM_DESKTOP,
+    NET_WM_STRUT_PARTIAL,
+    NET_WM_STRUT,
+    NET_WM_STATE,
+    NET_WM_STATE_STICKY,
+    NET_WM_STATE_ABOVE,
+    NET_WM_ATOM_MAX
+};
+
+static xcb_atom_t atom_list[NET_WM_ATOM_MAX];
+
+void
+get_ewmh_atoms (void)
+{
+    const char *atom_names[] = {
+        "_NET_WM_WINDOW_TYPE",
+        "_NET_WM_WINDOW_TYPE_DOCK",
+        "_NET_WM_DESKTOP",
+        "_NET_WM_STRUT_PARTIAL",
+        "_NET_WM_STRUT",
+        "_NET_WM_STATE",
+        // Leave those at the end since are batch-set
+        "_NET_WM_STATE_STICKY",
+        "_NET_WM_STATE_ABOVE",
+    };
+    const int atoms = sizeof(atom_names)/sizeof(char *);
+    xcb_intern_atom_cookie_t atom_cookie[atoms];
+    xcb_intern_atom_reply_t *atom_reply;
+
+    // As suggested fetch all the cookies first (yum!) and then retrieve the
+    // atoms to exploit the async'ness
+    for (int i = 0; i < atoms; i++)
+        atom_cookie[i] = xcb_intern_atom(c, 0, strlen(atom_names[i]), atom_names[i]);
+
+    for (int i = 0; i < atoms; i++) {
+        atom_reply = xcb_intern_atom_reply(c, atom_cookie[i], NULL);
+        if (!atom_reply) {
+            // Leave the atoms unset, set_ewmh_atoms does nothing then
+            atom_list[NET_WM_WINDOW_TYPE] = XCB_NONE;
+            for (i++; i < atoms; i++)
+                xcb_discard_reply(c, atom_cookie[i].sequence);
+            return;
+        }
+        atom_list[i] = atom_reply->atom;
+        free(atom_reply);
+    }
+}
+
+void
+set_ewmh_atoms (monitor_t *mon)
+{
+    int strut[12] = {0};
+
+    if (atom_list[NET_WM_WINDOW_TYPE] == XCB_NONE)
+        return;
+
+    // Prepare the strut array
+    if (topbar) {
+        strut[2] = bh;
+        strut[8] = mon->x;
+        strut[9] = mon->x + mon->width;
+    } else {
+        strut[3]  = bh;
+        strut[10] = mon->x;
+        strut[11] = mon->x + mon->width;
+    }
+
+    xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, atom_list[NET_WM_WINDOW_TYPE], XCB_ATOM_ATOM, 32, 1, &atom_list[NET_WM_WINDOW_TYPE_DOCK]);
+    xcb_change_property(c, XCB_PROP_MODE_APPEND,  mon->window, atom_list[NET_WM_STATE], XCB_ATOM_ATOM, 32, 2, &atom_list[NET_WM_STATE_STICKY]);
+    xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, atom_list[NET_WM_DESKTOP], XCB_ATOM_CARDINAL, 32, 1, (const uint32_t []) {
+        0u - 1u
+    } );
+    xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, atom_list[NET_WM_STRUT_PARTIAL], XCB_ATOM_CARDINAL, 32, 12, strut);
+    xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, atom_list[NET_WM_STRUT], XCB_ATOM_CARDINAL, 32, 4, strut);
+    xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 8, 3, "bar");
+    xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 8, 12, "lemonbar\0Bar");
+}
+
+monitor_t *
+monitor_new (int x, int y, int width, int height)
+{
+    monitor_t *ret;
+
+    y += topbar ? by : height - bh - by;
+
+    // Keep the window and the pixmap of a monitor whose geometry didn't change
+    for (monitor_t **m = &monspare; *m; m = &(*m)->next) {
+        if ((*m)->x == x && (*m)->y == y && (*m)->width == width) {
+            ret = *m;
+            *m = ret->next;
+            ret->next = ret->prev = NULL;
+#if WITH_PRESENT
+            // The events of the frames in flight may be lost along with the old layout
+            ret->present_busy = false;
+            ret->buffer_idle[0] = ret->buffer_idle[1] = true;
+#endif
+            return ret;
+        }
+    }
+
+    ret = calloc(1, sizeof(monitor_t));
+    if (!ret) {
+        fprintf(stderr, "Failed to allocate new monitor\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ret->x = x;
+    ret->y = y;
+    ret->width = width;
+    ret->next = ret->prev = NULL;
+    ret->window = xcb_generate_id(c);
+    int depth = (visual == scr->root_visual) ? XCB_COPY_FROM_PARENT : 32;
+    xcb_create_window(c, depth, ret->window, scr->root,
+                      ret->x, ret->y, width, bh, 0,
+                      XCB_WINDOW_CLASS_INPUT_OUTPUT, visual,
+                      XCB_CW_BACK_PIXEL | XCB_CW_BORDER_PIXEL | XCB_CW_OVERRIDE_REDIRECT | XCB_CW_EVENT_MASK | XCB_CW_COLORMAP,
+    (const uint32_t []) {
+        bgc.v, bgc.v, dock, XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_BUTTON_PRESS, colormap
+    });
+
+    ret->pixmap = xcb_generate_id(c);
+    xcb_create_pixmap(c, depth, ret->pixmap, ret->window, width, bh);
+
+    // The text is composited straight onto the pixmap
+    ret->picture = XRenderCreatePicture(dpy, ret->pixmap, pict_format, 0, NULL);
+
+#if WITH_SHM
+    if (shm_base)
+        shm_attach(ret);
+#endif
+#if WITH_PRESENT
+    if (present_opcode)
+        present_attach(ret);
+#endif
+
+    return ret;
+}
+
+void
+monitor_map (monitor_t *mon, char *wm_name, char *wm_instance)
+{
+    // For WM that support EWMH atoms
+    set_ewmh_atoms(mon);
+
+    // Make the bar visible and clear the pixmap
+    fill_rect(mon->pixmap, gc[GC_CLEAR], 0, 0, mon->width, bh);
+#if WITH_PRESENT
+    // The back buffer too, the first frame drawn into it only paints the damaged areas
+    if (mon->buffer[1])
+        fill_rect(mon->buffer[1], gc[GC_CLEAR], 0, 0, mon->width, bh);
+#endif
+    xcb_map_window(c, mon->window);
+
+    // Make sure that the window really gets in the place it's supposed to be
+    // Some WM such as Openbox need this
+    xcb_configure_window(c, mon->window, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y, (const uint32_t []){ mon->x, mon->y });
+
+    // Set the WM_NAME atom to the user specified value
+    if (wm_name)
+        xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 8 ,strlen(wm_name), wm_name);
+
+    // set the WM_CLASS atom instance to the executable name
+    if (wm_instance) {
+        char *wm_class;
+        int wm_class_offset, wm_class_len;
+
+        // WM_CLASS is nullbyte seperated: wm_instance + "\0Bar\0"
+        wm_class_offset = strlen(wm_instance) + 1;
+        wm_class_len = wm_class_offset + 4;
+
+        wm_class = calloc(1, wm_class_len + 1);
+        strcpy(wm_class, wm_instance);
+        strcpy(wm_class+wm_class_offset, "Bar");
+
+        xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 8, wm_class_len, wm_class);
+
+        free(wm_class);
+    }
+
+    mon->mapped = true;
+}
+
+void
+monitor_destroy (monitor_t *mon)
+{
+    XRenderFreePicture(dpy, mon->picture);
+#if WITH_SHM
+    shm_detach(mon);
+#endif
+#if WITH_PRESENT
+    present_detach(mon);
+#endif
+    xcb_destroy_window(c, mon->window);
+    xcb_free_pixmap(c, mon->pixmap);
+    free(mon->damage);
+    free(mon->areas.edge);
+    free(mon->areas.hit);
+    free(mon);
+}
+
+monitor_t *
+monitor_find (xcb_window_t win)
+{
+    for (monitor_t *mon = monhead; mon; mon = mon->next) {
+        if (mon->window == win)
+            return mon;
+    }
+    return NULL;
+}
+
+#if WITH_SHM
+monitor_t *
+monitor_find_pixmap (xcb_pixmap_t pixmap)
+{
+    for (monitor_t *mon = monhead; mon; mon = mon->next) {
+        if (mon->pixmap == pixmap)
+            return mon;
+    }
+    return NULL;
+}
+#endif
+
+void
+monitor_blit (monitor_t *mon, const xcb_rectangle_t *rects, const int count)
+{
+    for (int i = 0; i < count; i++)
+        xcb_copy_area(c, mon->pixmap, mon->window, gc[GC_DRAW],
+                rects[i].x, rects[i].y, rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+}
+
+void
+monitor_add (monitor_t *mon)
+{
+    if (!monhead) {
+        monhead = mon;
+    } else if (!montail) {
+        montail = mon;
+        monhead->next = mon;
+        mon->prev = monhead;
+    } else {
+        mon->prev = montail;
+        montail->next = mon;
+        montail = montail->next;
+    }
+}
+
+int
+rect_sort_cb (const void *p1, const void *p2)
+{
+    const xcb_rectangle_t *r1 = (xcb_rectangle_t *)p1;
+    const xcb_rectangle_t *r2 = (xcb_rectangle_t *)p2;
+
+    if (r1->x < r2->x || r1->y + r1->height <= r2->y)
+    {
+        return -1;
+    }
+
+    if (r1->x > r2->x || r1->y + r1->height > r2->y)
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+void
+monitor_create_chain (xcb_rectangle_t *rects, const int num)
+{
+    int i;
+    int width = 0, height = 0;
+    int left = bx;
+    int bar_width;
+
+    // Sort before use
+    qsort(rects, num, sizeof(xcb_rectangle_t), rect_sort_cb);
+
+    for (i = 0; i < num; i++) {
+        int h = rects[i].y + rects[i].height;
+        // Accumulated width of all monitors
+        width += rects[i].width;
+        // Get height of screen from y_offset + height of lowest monitor
+        if (h >= height)
+            height = h;
+    }
+
+    // The width is worked out again for every layout unless it was given by the user
+    bar_width = (bw < 0) ? width - bx : bw;
+
+    // Use the first font height as all the font heights have been set to the biggest of the set
+    if (bh < 0 || bh > height)
+        bh = font_list[0]->height + bu + 2;
+
+    // Check the geometry
+    if (bx + bar_width > width || by + bh > height) {
+        fprintf(stderr, "The geometry specified doesn't fit the screen!\n");
+        // Keep the old layout if this one comes from a screen change
+        if (monspare)
+            return;
+        exit(EXIT_FAILURE);
+    }
+
+    // Left is a positive number or zero therefore monitors with zero width are excluded
+    width = bar_width;
+    for (i = 0; i < num; i++) {
+        if (rects[i].y + rects[i].height < by)
+            continue;
+        if (rects[i].width > left) {
+            monitor_t *mon = monitor_new(
+                                 rects[i].x + left,
+                                 rects[i].y,
+                                 min(width, rects[i].width - left),
+                                 rects[i].height);
+
+            if (!mon)
+                break;
+
+            monitor_add(mon);
+
+            width -= rects[i].width - left;
+            // No need to check for other monitors
+            if (width <= 0)
+                break;
+        }
+
+        left -= rects[i].width;
+
+        if (left < 0)
+            left = 0;
+    }
+}
+
+void
+get_randr_monitors (void)
+{
+    xcb_randr_get_screen_resources_current_reply_t *rres_reply;
+    xcb_randr_output_t *outputs;
+    int i, j, num, valid = 0;
+
+    rres_reply = xcb_randr_get_screen_resources_current_reply(c,
+                 xcb_randr_get_screen_resources_current(c, scr->root), NULL);
+
+    if (!rres_reply) {
+        fprintf(stderr, "Failed to get current randr screen resources\n");
+        return;
+    }
+
+    num = xcb_randr_get_screen_resources_current_outputs_length(rres_reply);
+    outputs = xcb_randr_get_screen_resources_current_outputs(rres_reply);
+
+
+    // There should be at least one output
+    if (num < 1) {
+        free(rres_reply);
+        return;
+    }
+
+    xcb_rectangle_t rects[num];
+    xcb_randr_get_output_info_cookie_t oi_cookie[num];
+    xcb_randr_get_crtc_info_cookie_t ci_cookie[num];
+    xcb_randr_crtc_t crtc[num];
+
+    // Just like the atoms, send all the requests first and then collect the replies
+    for (i = 0; i < num; i++)
+        oi_cookie[i] = xcb_randr_get_output_info(c, outputs[i], XCB_CURRENT_TIME);
+
+    for (i = 0; i < num; i++) {
+        xcb_randr_get_output_info_reply_t *oi_reply;
+
+        oi_reply = xcb_randr_get_output_info_reply(c, oi_cookie[i], NULL);
+
+        // Output disconnected or not attached to any CRTC ?
+        if (!oi_reply || oi_reply->crtc == XCB_NONE || oi_reply->connection != XCB_RANDR_CONNECTION_CONNECTED)
+            crtc[i] = XCB_NONE;
+        else
+            crtc[i] = oi_reply->crtc;
+
+        free(oi_reply);
+    }
+
+    free(rres_reply);
+
+    // Now the same for the CRTCs of the connected outputs
+    for (i = 0; i < num; i++) {
+        if (crtc[i] != XCB_NONE)
+            ci_cookie[i] = xcb_randr_get_crtc_info(c, crtc[i], XCB_CURRENT_TIME);
+    }
+
+    for (i = 0; i < num; i++) {
+        xcb_randr_get_crtc_info_reply_t *ci_reply;
+
+        rects[i].width = 0;
+
+        if (crtc[i] == XCB_NONE)
+            continue;
+
+        ci_reply = xcb_randr_get_crtc_info_reply(c, ci_cookie[i], NULL);
+
+        if (!ci_reply) {
+            fprintf(stderr, "Failed to get RandR ctrc info\n");
+            // Discard the pending replies, nobody is going to wait for them
+            for (j = i + 1; j < num; j++) {
+                if (crtc[j] != XCB_NONE)
+                    xcb_discard_reply(c, ci_cookie[j].sequence);
+            }
+            return;
+        }
+
+        // There's no need to handle rotated screens here (see #69)
+        rects[i] = (xcb_rectangle_t){ ci_reply->x, ci_reply->y, ci_reply->width, ci_reply->height };
+
+        free(ci_reply);
+
+        valid++;
+    }
+
+    // Check for clones and inactive outputs
+    for (i = 0; i < num; i++) {
+        if (rects[i].width == 0)
+            continue;
+
+        for (j = 0; j < num; j++) {
+            // Does I contain J ?
+
+            if (i != j && rects[j].width) {
+                if (rects[j].x >= rects[i].x && rects[j].x + rects[j].width <= rects[i].x + rects[i].width &&
+                        rects[j].y >= rects[i].y && rects[j].y + rects[j].height <= rects[i].y + rects[i].height) {
+                    rects[j].width = 0;
+                    valid--;
+                }
+            }
+        }
+    }
+
+    if (valid < 1) {
+        fprintf(stderr, "No usable RandR output found\n");
+        return;
+    }
+
+    xcb_rectangle_t r[valid];
+
+    for (i = j = 0; i < num && j < valid; i++)
+        if (rects[i].width != 0)
+            r[j++] = rects[i];
+
+    monitor_create_chain(r, valid);
+}
+
+void
+monitor_update (char *wm_name, char *wm_instance)
+{
+    monitor_t *old_head = monhead, *old_tail = montail;
+
+    // Move the current monitors aside, the ones that didn't change are picked again by monitor_new
+    monspare = monhead;
+    monhead = montail = NULL;
+
+    get_randr_monitors();
+
+    if (!monhead) {
+        // Nothing usable was found, stick to the old layout
+        monhead = old_head;
+        montail = old_tail;
+        monspare = NULL;
+        return;
+    }
+
+    // Get rid of the monitors that are gone
+    while (monspare) {
+        monitor_t *next = monspare->next;
+        monitor_destroy(monspare);
+        monspare = next;
+    }
+
+    for (monitor_t *mon = monhead; mon; mon = mon->next) {
+        if (!mon->mapped)
+            monitor_map(mon, wm_name, wm_instance);
+    }
+
+    // The blocks of the last frame point to the old monitors, draw everything from scratch
+    mirror_reset();
+    full_redraw = true;
+}
+
+#ifdef WITH_XINERAMA
+void
+get_xinerama_monitors (void)
+{
+    xcb_xinerama_query_screens_reply_t *xqs_reply;
+    xcb_xinerama_screen_info_iterator_t iter;
+    int screens;
+
+    xqs_reply = xcb_xinerama_query_screens_reply(c,
+                xcb_xinerama_query_screens_unchecked(c), NULL);
+
+    iter = xcb_xinerama_query_screens_screen_info_iterator(xqs_reply);
+    screens = iter.rem;
+
+    xcb_rectangle_t rects[screens];
+
+    // Fetch all the screens first
+    for (int i = 0; iter.rem; i++) {
+        rects[i].x = iter.data->x_org;
+        rects[i].y = iter.data->y_org;
+        rects[i].width = iter.data->width;
+        rects[i].height = iter.data->height;
+        xcb_xinerama_screen_info_next(&iter);
+    }
+
+    free(xqs_reply);
+
+    monitor_create_chain(rects, screens);
+}
+#endif
+
+xcb_visualid_t
+get_visual (void)
+{
+
+    XVisualInfo xv; 
+    xv.depth = 32;
+    int result = 0;
+    XVisualInfo* result_ptr = NULL; 
+    result_ptr = XGetVisualInfo(dpy, VisualDepthMask, &xv, &result);
+
+    if (result > 0) {
+        visual_ptr = result_ptr->visual;
+        return result_ptr->visualid;
+    }
+    
+    //Fallback
+    visual_ptr = DefaultVisual(dpy, scr_nbr);	
+	return scr->root_visual;
+}
+
+// Parse an X-styled geometry string, we don't support signed offsets though.
+bool
+parse_geometry_string (char *str, int *tmp)
+{
+    char *p = str;
+    int i = 0, j;
+
+    if (!str || !str[0])
+        return false;
+
+    // The leading = is optional
+    if (*p == '=')
+        p++;
+
+    while (*p) {
+        // A geometry string has only 4 fields
+        if (i >= 4) {
+            fprintf(stderr, "Invalid geometry specified\n");
+            return false;
+        }
+        // Move on if we encounter a 'x' or '+'
+        if (*p == 'x') {
+            if (i > 0) // The 'x' must precede '+'
+                break;
+            i++; p++; continue;
+        }
+        if (*p == '+') {
+            if (i < 1) // Stray '+', skip the first two fields
+                i = 2;
+            else
+                i++;
+            p++; continue;
+        }
+        // A digit must follow
+        if (!isdigit(*p)) {
+            fprintf(stderr, "Invalid geometry specified\n");
+            return false;
+        }
+        // Try to parse the number
+        errno = 0;
+        j = strtoul(p, &p, 10);
+        if (errno) {
+            fprintf(stderr, "Invalid geometry specified\n");
+            return false;
+        }
+        tmp[i] = j;
+    }
+
+    return true;
+}
+
+void
+xconn (void)
+{
+    if ((dpy = XOpenDisplay(0)) == NULL) {
+        fprintf (stderr, "Couldnt open display\n");
+    }
+
+    if ((c = XGetXCBConnection(dpy)) == NULL) {
+        fprintf (stderr, "Couldnt connect to X\n");
+        exit (EXIT_FAILURE);
+    }
+
+	XSetEventQueueOwner(dpy, XCBOwnsEventQueue);
+
+    if (xcb_connection_has_error(c)) {
+        fprintf(stderr, "Couldn't connect to X\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Grab infos from the first screen */
+    scr = xcb_setup_roots_iterator(xcb_get_setup(c)).data;
+
+    /* Try to get a RGBA visual and build the colormap for that */
+	visual = get_visual();
+    colormap = xcb_generate_id(c);
+    xcb_create_colormap(c, XCB_COLORMAP_ALLOC_NONE, colormap, scr->root, visual);
+}
+
+void
+init (char *wm_name, char *wm_instance)
+{
+    // Only the first usable font is needed to size the bar, the others are loaded when a
+    // character can't be drawn with the ones before them. Drop the fonts that fail to load along
+    // with their offset.
+    while (font_count && !font_resolve(font_list[0])) {
+        free(font_list[0]);
+        memmove(font_list, font_list + 1, --font_count * sizeof(font_t *));
+        memmove(offsets_y, offsets_y + 1, (MAX_FONT_COUNT - 1) * sizeof(int));
+        font_list[font_count] = NULL;
+    }
+
+    // Try to load a default font
+    if (!font_count) {
+        font_load("fixed");
+        if (!font_resolve(font_list[0])) {
+            free(font_list[0]);
+            font_list[0] = NULL;
+            font_count = 0;
+        }
+    }
+
+    // We tried and failed hard, there's something wrong
+    if (!font_count)
+        exit(EXIT_FAILURE);
+
+    coverage_reset();
+
+    const int maxh = font_list[0]->height;
+
+    // Generate a list of screens
+    const xcb_query_extension_reply_t *qe_reply;
+
+    // Initialize monitor list head and tail
+    monhead = montail = NULL;
+
+    // The text is drawn with the RENDER extension
+    int render_event, render_error;
+    if (!XRenderQueryExtension(dpy, &render_event, &render_error) ||
+            !(pict_format = XRenderFindVisualFormat(dpy, visual_ptr))) {
+        fprintf(stderr, "The RENDER extension is not available\n");
+        exit(EXIT_FAILURE);
+    }
+
+#if WITH_SHM
+    // Render on the client side when the server is local
+    shm_init();
+#endif
+#if WITH_PRESENT
+    // Swap the frames at the vertical blank
+    present_init();
+#endif
+
+    // Check if RandR is present
+    qe_reply = xcb_get_extension_data(c, &xcb_randr_id);
+
+    if (qe_reply && qe_reply->present) {
+        xcb_randr_query_version_reply_t *qv_reply;
+
+        // The output and crtc notifications are only sent to clients speaking RandR 1.2 or newer
+        qv_reply = xcb_randr_query_version_reply(c, xcb_randr_query_version(c, 1, 5), NULL);
+
+        if (qv_reply && (qv_reply->major_version > 1 || qv_reply->minor_version >= 2)) {
+            // Follow the monitors being plugged, unplugged or moved around
+            randr_base = qe_reply->first_event;
+            xcb_randr_select_input(c, scr->root,
+                    XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE |
+                    XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE |
+                    XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE);
+        }
+
+        free(qv_reply);
+
+        get_randr_monitors();
+    }
+#if WITH_XINERAMA
+    else {
+        qe_reply = xcb_get_extension_data(c, &xcb_xinerama_id);
+
+        // Check if Xinerama extension is present and active
+        if (qe_reply && qe_reply->present) {
+            xcb_xinerama_is_active_reply_t *xia_reply;
+            xia_reply = xcb_xinerama_is_active_reply(c, xcb_xinerama_is_active(c), NULL);
+
+            if (xia_reply && xia_reply->state)
+                get_xinerama_monitors();
+
+            free(xia_reply);
+        }
+    }
+#endif
+
+    if (!monhead) {
+        // If I fits I sits
+        if (bw < 0)
+            bw = scr->width_in_pixels - bx;
 
-    for (int i = 0; i < atoms; i++) {
-        atom_reply = xcb_intern_atom_reply(c, atom_cookie[i], NULL);
-        if (!atom_reply)
-            return;
-        atom_list[i] = atom_reply->atom;
-        free(atom_reply);
-    }
+        // Adjust the height
+        if (bh < 0 || bh > scr->height_in_pixels)
+            bh = maxh + bu + 2;
 
-    // Prepare the strut array
-    for (monitor_t *mon = monhead; mon; mon = mon->next) {
-        int strut[12] = {0};
-        if (topbar) {
-            strut[2] = bh;
-            strut[8] = mon->x;
-            strut[9] = mon->x + mon->width;
-        } else {
-            strut[3]  = bh;
-            strut[10] = mon->x;
-            strut[11] = mon->x + mon->width;
+        // Check the geometry
+        if (bx + bw > scr->width_in_pixels || by + bh > scr->height_in_pixels) {
+            fprintf(stderr, "The geometry specified doesn't fit the screen!\n");
+            exit(EXIT_FAILURE);
         }
 
-        xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, atom_list[NET_WM_WINDOW_TYPE], XCB_ATOM_ATOM, 32, 1, &atom_list[NET_WM_WINDOW_TYPE_DOCK]);
-        xcb_change_property(c, XCB_PROP_MODE_APPEND,  mon->window, atom_list[NET_WM_STATE], XCB_ATOM_ATOM, 32, 2, &atom_list[NET_WM_STATE_STICKY]);
-        xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, atom_list[NET_WM_DESKTOP], XCB_ATOM_CARDINAL, 32, 1, (const uint32_t []) {
-            0u - 1u
-        } );
-        xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, atom_list[NET_WM_STRUT_PARTIAL], XCB_ATOM_CARDINAL, 32, 12, strut);
-        xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, atom_list[NET_WM_STRUT], XCB_ATOM_CARDINAL, 32, 4, strut);
-        xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 8, 3, "bar");
-        xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 8, 12, "lemonbar\0Bar");
+        // If no RandR outputs or Xinerama screens, fall back to using whole screen
+        monhead = monitor_new(0, 0, bw, scr->height_in_pixels);
     }
-}
-
-monitor_t *
-monitor_new (int x, int y, int width, int height)
-{
-    monitor_t *ret;
 
-    ret = calloc(1, sizeof(monitor_t));
-    if (!ret) {
-        fprintf(stderr, "Failed to allocate new monitor\n");
+    if (!monhead)
         exit(EXIT_FAILURE);
-    }
-
-    ret->x = x;
-    ret->y = (topbar ? by : height - bh - by) + y;
-    ret->width = width;
-    ret->next = ret->prev = NULL;
-    ret->window = xcb_generate_id(c);
-    int depth = (visual == scr->root_visual) ? XCB_COPY_FROM_PARENT : 32;
-    xcb_create_window(c, depth, ret->window, scr->root,
-                      ret->x, ret->y, width, bh, 0,
-                      XCB_WINDOW_CLASS_INPUT_OUTPUT, visual,
-                      XCB_CW_BACK_PIXEL | XCB_CW_BORDER_PIXEL | XCB_CW_OVERRIDE_REDIRECT | XCB_CW_EVENT_MASK | XCB_CW_COLORMAP,
-    (const uint32_t []) {
-        bgc.v, bgc.v, dock, XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_BUTTON_PRESS, colormap
-    });
 
-    ret->pixmap = xcb_generate_id(c);
-    xcb_create_pixmap(c, depth, ret->pixmap, ret->window, width, bh);
+    // For WM that support EWMH atoms
+    get_ewmh_atoms();
 
-    return ret;
-}
+    // Create the gc for drawing
+    gc[GC_DRAW] = xcb_generate_id(c);
+    xcb_create_gc(c, gc[GC_DRAW], monhead->pixmap, XCB_GC_FOREGROUND, (const uint32_t []){ fgc.v });
 
-void
-monitor_add (monitor_t *mon)
-{
-    if (!monhead) {
-        monhead = mon;
-    } else if (!montail) {
-        montail = mon;
-        monhead->next = mon;
-        mon->prev = monhead;
-    } else {
-        mon->prev = montail;
-        montail->next = mon;
-        montail = montail->next;
-    }
-}
+    gc[GC_CLEAR] = xcb_generate_id(c);
+    xcb_create_gc(c, gc[GC_CLEAR], monhead->pixmap, XCB_GC_FOREGROUND, (const uint32_t []){ bgc.v });
 
-int
-rect_sort_cb (const void *p1, const void *p2)
-{
-    const xcb_rectangle_t *r1 = (xcb_rectangle_t *)p1;
-    const xcb_rectangle_t *r2 = (xcb_rectangle_t *)p2;
+    gc[GC_ATTR] = xcb_generate_id(c);
+    xcb_create_gc(c, gc[GC_ATTR], monhead->pixmap, XCB_GC_FOREGROUND, (const uint32_t []){ ugc.v });
 
-    if (r1->x < r2->x || r1->y + r1->height <= r2->y)
-    {
-        return -1;
-    }
+    gc_color[GC_DRAW] = fgc;
+    gc_color[GC_CLEAR] = bgc;
+    gc_color[GC_ATTR] = ugc;
 
-    if (r1->x > r2->x || r1->y + r1->height > r2->y)
-    {
-        return 1;
-    }
+    for (monitor_t *mon = monhead; mon; mon = mon->next)
+        monitor_map(mon, wm_name, wm_instance);
 
-    return 0;
+    xcb_flush(c);
 }
 
-void
-monitor_create_chain (xcb_rectangle_t *rects, const int num)
+// Read everything available from fd, returns true if at least one new complete line was found.
+// Every line is passed to each and only the newest line it accepts is kept in r->line.
+bool
+reader_fill (reader_t *r, int fd, bool (*each)(char *))
 {
-    int i;
-    int width = 0, height = 0;
-    int left = bx;
-
-    // Sort before use
-    qsort(rects, num, sizeof(xcb_rectangle_t), rect_sort_cb);
-
-    for (i = 0; i < num; i++) {
-        int h = rects[i].y + rects[i].height;
-        // Accumulated width of all monitors
-        width += rects[i].width;
-        // Get height of screen from y_offset + height of lowest monitor
-        if (h >= height)
-            height = h;
-    }
+    bool got_line = false;
 
-    if (bw < 0)
-        bw = width - bx;
+    for (;;) {
+        // Make some room by dropping everything but the newest line and the one being received,
+        // grow the buffer if that's not enough. A byte is always kept free for the terminator.
+        if (r->cap - r->len - 1 < READ_CHUNK) {
+            int to = 0;
+
+            if (r->line >= 0) {
+                memmove(r->buf, r->buf + r->line, r->line_end - r->line);
+                r->line_end -= r->line;
+                r->line = 0;
+                to = r->line_end;
+            }
+            if (r->head > to) {
+                memmove(r->buf + to, r->buf + r->head, r->len - r->head);
+                r->len -= r->head - to;
+                r->head = to;
+            }
 
-    // Use the first font height as all the font heights have been set to the biggest of the set
-    if (bh < 0 || bh > height)
-        bh = font_list[0]->height + bu + 2;
+            r->buf = grow_array(r->buf, &r->cap, r->len + READ_CHUNK + 1, 1);
+        }
 
-    // Check the geometry
-    if (bx + bw > width || by + bh > height) {
-        fprintf(stderr, "The geometry specified doesn't fit the screen!\n");
-        exit(EXIT_FAILURE);
-    }
+        const ssize_t n = read(fd, r->buf + r->len, r->cap - r->len - 1);
 
-    // Left is a positive number or zero therefore monitors with zero width are excluded
-    width = bw;
-    for (i = 0; i < num; i++) {
-        if (rects[i].y + rects[i].height < by)
-            continue;
-        if (rects[i].width > left) {
-            monitor_t *mon = monitor_new(
-                                 rects[i].x + left,
-                                 rects[i].y,
-                                 min(width, rects[i].width - left),
-                                 rects[i].height);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                r->eof = true;
+            break;
+        }
 
-            if (!mon)
-                break;
+        if (n == 0) {
+            // Treat an unterminated trailing line as a complete one
+            if (r->head < r->len) {
+                stats.lines++;
+                r->buf[r->len++] = '\0';
+                if (each(r->buf + r->head)) {
+                    r->line = r->head;
+                    r->line_end = r->len;
+                }
+                r->head = r->len;
+                got_line = true;
+            }
+            r->eof = true;
+            break;
+        }
 
-            monitor_add(mon);
+        // Terminate every line so that it can be parsed in place
+        for (char *q = r->buf + r->len; (q = memchr(q, '\n', r->buf + r->len + n - q)); q++) {
+            const int nl = q - r->buf;
 
-            width -= rects[i].width - left;
-            // No need to check for other monitors
-            if (width <= 0)
-                break;
+            stats.lines++;
+            *q = '\0';
+            if (each(r->buf + r->head)) {
+                r->line = r->head;
+                r->line_end = nl + 1;
+            }
+            r->head = nl + 1;
+            got_line = true;
         }
+        r->len += n;
 
-        left -= rects[i].width;
-
-        if (left < 0)
-            left = 0;
+        if (r->max_line && r->len - r->head > r->max_line) {
+            fprintf(stderr, "Dropping an input sending a line longer than %d bytes\n", r->max_line);
+            r->eof = true;
+            break;
+        }
     }
+
+    return got_line;
 }
 
 void
-get_randr_monitors (void)
+sock_open (const char *path)
 {
-    xcb_randr_get_screen_resources_current_reply_t *rres_reply;
-    xcb_randr_output_t *outputs;
-    int i, j, num, valid = 0;
-
-    rres_reply = xcb_randr_get_screen_resources_current_reply(c,
-                 xcb_randr_get_screen_resources_current(c, scr->root), NULL);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat st;
 
-    if (!rres_reply) {
-        fprintf(stderr, "Failed to get current randr screen resources\n");
-        return;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "The socket path is too long\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+
+    // Get rid of the socket left behind by a previous instance, and nothing else. A socket
+    // somebody's still listening on belongs to a running bar.
+    if (!stat(path, &st) && S_ISSOCK(st.st_mode)) {
+        const int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        const int ret = (probe < 0) ? -1 : connect(probe, (struct sockaddr *)&addr, sizeof(addr));
+        const int err = errno;
+
+        if (probe >= 0)
+            close(probe);
+        if (!ret) {
+            fprintf(stderr, "Another instance is listening on %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+        if (err == ECONNREFUSED)
+            unlink(path);
     }
 
-    num = xcb_randr_get_screen_resources_current_outputs_length(rres_reply);
-    outputs = xcb_randr_get_screen_resources_current_outputs(rres_reply);
-
+    // Only the user running the bar may connect, the socket is created with no access for the
+    // others rather than restricted once it's reachable
+    sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    const mode_t mask = umask(0077);
+    const int bound = (sock_fd < 0) ? -1 : bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
 
-    // There should be at least one output
-    if (num < 1) {
-        free(rres_reply);
-        return;
+    if (bound < 0 || listen(sock_fd, MAX_CLIENTS) < 0) {
+        fprintf(stderr, "Couldn't listen on %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
     }
+    sock_path = strdup(path);
 
-    xcb_rectangle_t rects[num];
+    fcntl(sock_fd, F_SETFL, O_NONBLOCK);
 
-    // Get all outputs
-    for (i = 0; i < num; i++) {
-        xcb_randr_get_output_info_reply_t *oi_reply;
-        xcb_randr_get_crtc_info_reply_t *ci_reply;
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        client[i].fd = -1;
+}
 
-        oi_reply = xcb_randr_get_output_info_reply(c, xcb_randr_get_output_info(c, outputs[i], XCB_CURRENT_TIME), NULL);
+void
+sock_accept (void)
+{
+    int fd;
 
-        // Output disconnected or not attached to any CRTC ?
-        if (!oi_reply || oi_reply->crtc == XCB_NONE || oi_reply->connection != XCB_RANDR_CONNECTION_CONNECTED) {
-            free(oi_reply);
-            rects[i].width = 0;
+    while ((fd = accept(sock_fd, NULL, NULL)) >= 0) {
+        int i;
+
+        for (i = 0; i < MAX_CLIENTS && client[i].fd >= 0; i++)
+            ;
+
+        if (i == MAX_CLIENTS) {
+            fprintf(stderr, "Too many producers connected, dropping the new one\n");
+            close(fd);
             continue;
         }
 
-        ci_reply = xcb_randr_get_crtc_info_reply(c,
-                   xcb_randr_get_crtc_info(c, oi_reply->crtc, XCB_CURRENT_TIME), NULL);
+        // A producer that stalls mustn't block the others
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        client[i] = (client_t){ .fd = fd, .reader = { .line = -1, .max_line = MAX_CLIENT_LINE } };
+    }
+}
 
-        free(oi_reply);
+bool
+client_line (char *line)
+{
+    region_update(line);
+    return false;
+}
 
-        if (!ci_reply) {
-            fprintf(stderr, "Failed to get RandR ctrc info\n");
-            free(rres_reply);
-            return;
-        }
+void
+client_close (client_t *cl)
+{
+    // The regions are left as they are, a producer being restarted doesn't make the bar flicker
+    close(cl->fd);
+    free(cl->reader.buf);
+    *cl = (client_t){ .fd = -1 };
+}
 
-        // There's no need to handle rotated screens here (see #69)
-        rects[i] = (xcb_rectangle_t){ ci_reply->x, ci_reply->y, ci_reply->width, ci_reply->height };
+// Read a small file such as the ones in /proc and /sys, the trailing newline is dropped
+bool
+read_small_file (const char *path, char *buf, const size_t size)
+{
+    const int fd = open(path, O_RDONLY);
+    ssize_t n;
 
-        free(ci_reply);
+    if (fd < 0)
+        return false;
+    n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0)
+        return false;
 
-        valid++;
-    }
+    while (n > 0 && buf[n - 1] == '\n')
+        n--;
+    buf[n] = '\0';
 
-    free(rres_reply);
+    return true;
+}
 
-    // Check for clones and inactive outputs
-    for (i = 0; i < num; i++) {
-        if (rects[i].width == 0)
-            continue;
+void
+source_clock (const char *arg, char *buf, const size_t size)
+{
+    const time_t now = time(NULL);
+    struct tm tm;
 
-        for (j = 0; j < num; j++) {
-            // Does I contain J ?
+    if (!localtime_r(&now, &tm) || !strftime(buf, size, arg, &tm))
+        buf[0] = '\0';
+}
 
-            if (i != j && rects[j].width) {
-                if (rects[j].x >= rects[i].x && rects[j].x + rects[j].width <= rects[i].x + rects[i].width &&
-                        rects[j].y >= rects[i].y && rects[j].y + rects[j].height <= rects[i].y + rects[i].height) {
-                    rects[j].width = 0;
-                    valid--;
-                }
-            }
-        }
-    }
+void
+source_load (const char *arg, char *buf, const size_t size)
+{
+    char *p = buf;
 
-    if (valid < 1) {
-        fprintf(stderr, "No usable RandR output found\n");
+    if (!read_small_file("/proc/loadavg", buf, size)) {
+        buf[0] = '\0';
         return;
     }
 
-    xcb_rectangle_t r[valid];
-
-    for (i = j = 0; i < num && j < valid; i++)
-        if (rects[i].width != 0)
-            r[j++] = rects[i];
-
-    monitor_create_chain(r, valid);
+    // Keep the 1, 5 and 15 minutes averages only
+    for (int i = 0; i < 3 && p; i++)
+        p = strchr(p + 1, ' ');
+    if (p)
+        *p = '\0';
 }
 
-#ifdef WITH_XINERAMA
 void
-get_xinerama_monitors (void)
+source_memory (const char *arg, char *buf, const size_t size)
 {
-    xcb_xinerama_query_screens_reply_t *xqs_reply;
-    xcb_xinerama_screen_info_iterator_t iter;
-    int screens;
+    char info[4096];
+    const char *total, *avail;
 
-    xqs_reply = xcb_xinerama_query_screens_reply(c,
-                xcb_xinerama_query_screens_unchecked(c), NULL);
+    buf[0] = '\0';
+    if (!read_small_file("/proc/meminfo", info, sizeof(info)))
+        return;
 
-    iter = xcb_xinerama_query_screens_screen_info_iterator(xqs_reply);
-    screens = iter.rem;
+    total = strstr(info, "MemTotal:");
+    avail = strstr(info, "MemAvailable:");
+    if (!total || !avail)
+        return;
 
-    xcb_rectangle_t rects[screens];
+    const unsigned long long t = strtoull(total + 9, NULL, 10);
+    const unsigned long long a = strtoull(avail + 13, NULL, 10);
 
-    // Fetch all the screens first
-    for (int i = 0; iter.rem; i++) {
-        rects[i].x = iter.data->x_org;
-        rects[i].y = iter.data->y_org;
-        rects[i].width = iter.data->width;
-        rects[i].height = iter.data->height;
-        xcb_xinerama_screen_info_next(&iter);
-    }
+    // The percentage of memory in use
+    if (t && a <= t)
+        snprintf(buf, size, "%llu%%", (t - a) * 100 / t);
+}
+
+void
+source_battery (const char *arg, char *buf, const size_t size)
+{
+    char path[256], capacity[16], status[32];
 
-    free(xqs_reply);
+    buf[0] = '\0';
+    snprintf(path, sizeof(path), "/sys/class/power_supply/%s/capacity", arg);
+    if (!read_small_file(path, capacity, sizeof(capacity)))
+        return;
+    snprintf(path, sizeof(path), "/sys/class/power_supply/%s/status", arg);
+    if (!read_small_file(path, status, sizeof(status)))
+        status[0] = '\0';
 
-    monitor_create_chain(rects, screens);
+    // A trailing + tells the battery is charging
+    snprintf(buf, size, "%s%%%s", capacity, strcmp(status, "Charging") ? "" : "+");
 }
-#endif
 
-xcb_visualid_t
-get_visual (void)
+enum {
+    SOURCE_CLOCK = 0,
+    SOURCE_LOAD,
+    SOURCE_MEMORY,
+    SOURCE_BATTERY,
+    SOURCE_MAX
+};
+
+static const struct {
+    const char *name;
+    void (*fill)(const char *arg, char *buf, const size_t size);
+    int interval;
+    const char *arg;
+} source_kind[SOURCE_MAX] = {
+    [SOURCE_CLOCK]   = { "clock",   source_clock,   60, "%H:%M" },
+    [SOURCE_LOAD]    = { "load",    source_load,    5,  NULL },
+    [SOURCE_MEMORY]  = { "memory",  source_memory,  5,  NULL },
+    [SOURCE_BATTERY] = { "battery", source_battery, 30, "BAT0" },
+};
+
+// Parse a source given as [region=]kind[:interval[:argument]], the argument is the rest of the
+// string so that it can hold colons (think of the clock format). The region is named after the
+// kind unless told otherwise, so that the same kind can be used more than once.
+void
+source_add (const char *spec)
 {
+    const char *eq = strchr(spec, '=');
+    source_t *s = &source[sources];
+    char *name = NULL;
+    int kind;
+
+    if (eq && eq < spec + strcspn(spec, ":")) {
+        if (eq == spec) {
+            fprintf(stderr, "The region name of the source \"%s\" is empty\n", spec);
+            exit(EXIT_FAILURE);
+        }
+        name = strndup(spec, eq - spec);
+        spec = eq + 1;
+    }
 
-    XVisualInfo xv; 
-    xv.depth = 32;
-    int result = 0;
-    XVisualInfo* result_ptr = NULL; 
-    result_ptr = XGetVisualInfo(dpy, VisualDepthMask, &xv, &result);
+    const size_t len = strcspn(spec, ":");
 
-    if (result > 0) {
-        visual_ptr = result_ptr->visual;
-        return result_ptr->visualid;
+    for (kind = 0; kind < SOURCE_MAX; kind++) {
+        if (strlen(source_kind[kind].name) == len && !strncmp(spec, source_kind[kind].name, len))
+            break;
     }
-    
-    //Fallback
-    visual_ptr = DefaultVisual(dpy, scr_nbr);	
-	return scr->root_visual;
-}
 
-// Parse an X-styled geometry string, we don't support signed offsets though.
-bool
-parse_geometry_string (char *str, int *tmp)
-{
-    char *p = str;
-    int i = 0, j;
+    if (kind == SOURCE_MAX) {
+        fprintf(stderr, "Unknown source \"%.*s\"\n", (int)len, spec);
+        exit(EXIT_FAILURE);
+    }
+    if (sources == MAX_SOURCES) {
+        fprintf(stderr, "Too many sources, at most %d can be used\n", MAX_SOURCES);
+        exit(EXIT_FAILURE);
+    }
 
-    if (!str || !str[0])
-        return false;
+    *s = (source_t){ .kind = kind, .fd = -1, .interval = source_kind[kind].interval };
+    s->name = name ? name : strdup(source_kind[kind].name);
 
-    // The leading = is optional
-    if (*p == '=')
-        p++;
+    spec += len;
+    if (*spec == ':') {
+        char *end;
+        const long interval = strtol(spec + 1, &end, 10);
 
-    while (*p) {
-        // A geometry string has only 4 fields
-        if (i >= 4) {
-            fprintf(stderr, "Invalid geometry specified\n");
-            return false;
-        }
-        // Move on if we encounter a 'x' or '+'
-        if (*p == 'x') {
-            if (i > 0) // The 'x' must precede '+'
-                break;
-            i++; p++; continue;
-        }
-        if (*p == '+') {
-            if (i < 1) // Stray '+', skip the first two fields
-                i = 2;
-            else
-                i++;
-            p++; continue;
-        }
-        // A digit must follow
-        if (!isdigit(*p)) {
-            fprintf(stderr, "Invalid geometry specified\n");
-            return false;
-        }
-        // Try to parse the number
-        errno = 0;
-        j = strtoul(p, &p, 10);
-        if (errno) {
-            fprintf(stderr, "Invalid geometry specified\n");
-            return false;
+        if (end != spec + 1) {
+            if (interval < 1) {
+                fprintf(stderr, "The interval of the source \"%s\" must be at least a second\n", source_kind[kind].name);
+                exit(EXIT_FAILURE);
+            }
+            s->interval = interval;
         }
-        tmp[i] = j;
+        spec = end;
     }
 
-    return true;
+    if (*spec == ':')
+        s->arg = strdup(spec + 1);
+    else if (source_kind[kind].arg)
+        s->arg = strdup(source_kind[kind].arg);
+
+    if (!s->name || ((*spec == ':' || source_kind[kind].arg) && !s->arg)) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    sources++;
 }
 
 void
-xconn (void)
+source_run (source_t *s)
 {
-    if ((dpy = XOpenDisplay(0)) == NULL) {
-        fprintf (stderr, "Couldnt open display\n");
-    }
+    char buf[256];
 
-    if ((c = XGetXCBConnection(dpy)) == NULL) {
-        fprintf (stderr, "Couldnt connect to X\n");
-        exit (EXIT_FAILURE);
-    }
+    source_kind[s->kind].fill(s->arg, buf, sizeof(buf));
+    region_set(region_get(s->name), buf);
+}
 
-	XSetEventQueueOwner(dpy, XCBOwnsEventQueue);
+// Fire on the multiples of the interval, a clock showing the minutes changes right when the minute
+// does. The timer is cancelled when the clock is set, it has to be armed again then.
+void
+source_arm (source_t *s)
+{
+    struct timespec now;
+    struct itimerspec when = { .it_interval = { .tv_sec = s->interval } };
 
-    if (xcb_connection_has_error(c)) {
-        fprintf(stderr, "Couldn't connect to X\n");
+    clock_gettime(CLOCK_REALTIME, &now);
+    when.it_value.tv_sec = (now.tv_sec / s->interval + 1) * s->interval;
+    timerfd_settime(s->fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &when, NULL);
+}
+
+void
+source_start (source_t *s)
+{
+    s->fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (s->fd < 0) {
+        fprintf(stderr, "Couldn't create the timer of the source \"%s\"\n", s->name);
         exit(EXIT_FAILURE);
     }
 
-    /* Grab infos from the first screen */
-    scr = xcb_setup_roots_iterator(xcb_get_setup(c)).data;
+    source_arm(s);
+    source_run(s);
+}
 
-    /* Try to get a RGBA visual and build the colormap for that */
-	visual = get_visual();
-    colormap = xcb_generate_id(c);
-    xcb_create_colormap(c, XCB_COLORMAP_ALLOC_NONE, colormap, scr->root, visual);
+// Drop the oldest click that can be dropped, the one being written has to be finished
+void
+click_drop (void)
+{
+    const int i = (clickq.written && clickq.count > 1) ? (clickq.head + 1) % MAX_QUEUED_CLICKS : clickq.head;
+
+    free(clickq.cmd[i]);
+    if (i != clickq.head)
+        clickq.cmd[i] = clickq.cmd[clickq.head];
+    else
+        clickq.written = 0;
+    clickq.head = (clickq.head + 1) % MAX_QUEUED_CLICKS;
+    clickq.count--;
+    stats.clicks_dropped++;
 }
 
 void
-init (char *wm_name, char *wm_instance)
+click_push (const char *cmd)
 {
-    // Try to load a default font
-    if (!font_count)
-        font_load("fixed");
+    const size_t len = strlen(cmd);
+    char *line;
+
+    if (clickq.count == MAX_QUEUED_CLICKS) {
+        if (clickq.coalesce) {
+            for (int i = 0; i < clickq.count; i++) {
+                const char *queued = clickq.cmd[(clickq.head + i) % MAX_QUEUED_CLICKS];
+                if (!strncmp(queued, cmd, len) && queued[len] == '\n' && !queued[len + 1]) {
+                    stats.clicks_dropped++;
+                    return;
+                }
+            }
+        }
+        click_drop();
+    }
 
-    // We tried and failed hard, there's something wrong
-    if (!font_count)
+    line = malloc(len + 2);
+    if (!line) {
+        fprintf(stderr, "Failed to allocate memory\n");
         exit(EXIT_FAILURE);
+    }
+    memcpy(line, cmd, len);
+    line[len] = '\n';
+    line[len + 1] = '\0';
 
-    // To make the alignment uniform, find maximum height
-    int maxh = font_list[0]->height;
-    for (int i = 1; i < font_count; i++)
-        maxh = max(maxh, font_list[i]->height);
+    clickq.cmd[(clickq.head + clickq.count++) % MAX_QUEUED_CLICKS] = line;
+}
 
-    // Set maximum height to all fonts
-    for (int i = 0; i < font_count; i++)
-        font_list[i]->height = maxh;
+// The standard output is shared with whoever started the bar (think of a terminal, whose stderr
+// is the same file), its flags are left alone. A pipe or a terminal is opened again to get a
+// description that can be made non blocking, a socket is written with MSG_DONTWAIT and a regular
+// file never blocks anyway.
+void
+click_open (void)
+{
+    struct stat st;
 
-    // Generate a list of screens
-    const xcb_query_extension_reply_t *qe_reply;
+    clickq.fd = STDOUT_FILENO;
+    if (fstat(STDOUT_FILENO, &st) < 0)
+        return;
 
-    // Initialize monitor list head and tail
-    monhead = montail = NULL;
+    if (S_ISSOCK(st.st_mode)) {
+        clickq.sock = true;
+    } else if (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode)) {
+        const int fd = open("/proc/self/fd/1", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd >= 0)
+            clickq.fd = fd;
+        else
+            fprintf(stderr, "Couldn't reopen the standard output, the clicks may block: %s\n", strerror(errno));
+    }
+}
 
-    // Check if RandR is present
-    qe_reply = xcb_get_extension_data(c, &xcb_randr_id);
+// Write as many queued clicks as the standard output takes with a single request
+void
+click_flush (void)
+{
+    struct iovec iov[MAX_QUEUED_CLICKS];
+    ssize_t n;
 
-    if (qe_reply && qe_reply->present) {
-        get_randr_monitors();
+    for (int i = 0; i < clickq.count; i++) {
+        char *cmd = clickq.cmd[(clickq.head + i) % MAX_QUEUED_CLICKS];
+        const size_t skip = i ? 0 : clickq.written;
+        iov[i] = (struct iovec){ .iov_base = cmd + skip, .iov_len = strlen(cmd) - skip };
     }
-#if WITH_XINERAMA
-    else {
-        qe_reply = xcb_get_extension_data(c, &xcb_xinerama_id);
-
-        // Check if Xinerama extension is present and active
-        if (qe_reply && qe_reply->present) {
-            xcb_xinerama_is_active_reply_t *xia_reply;
-            xia_reply = xcb_xinerama_is_active_reply(c, xcb_xinerama_is_active(c), NULL);
 
-            if (xia_reply && xia_reply->state)
-                get_xinerama_monitors();
+    do
+        n = clickq.sock ? sendmsg(clickq.fd, &(struct msghdr){ .msg_iov = iov, .msg_iovlen = clickq.count }, MSG_DONTWAIT)
+                        : writev(clickq.fd, iov, clickq.count);
+    while (n < 0 && errno == EINTR);
 
-            free(xia_reply);
-        }
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+        // Nobody's listening, there's no point in keeping the clicks around
+        fprintf(stderr, "Couldn't write the clicks: %s\n", strerror(errno));
+        while (clickq.count)
+            click_drop();
+        return;
     }
-#endif
 
-    if (!monhead) {
-        // If I fits I sits
-        if (bw < 0)
-            bw = scr->width_in_pixels - bx;
-
-        // Adjust the height
-        if (bh < 0 || bh > scr->height_in_pixels)
-            bh = maxh + bu + 2;
+    // Retire what has been written, the last command may be left halfway
+    while (n > 0) {
+        char *cmd = clickq.cmd[clickq.head];
+        const size_t left = strlen(cmd) - clickq.written;
 
-        // Check the geometry
-        if (bx + bw > scr->width_in_pixels || by + bh > scr->height_in_pixels) {
-            fprintf(stderr, "The geometry specified doesn't fit the screen!\n");
-            exit(EXIT_FAILURE);
+        if ((size_t)n < left) {
+            clickq.written += n;
+            break;
         }
 
-        // If no RandR outputs or Xinerama screens, fall back to using whole screen
-        monhead = monitor_new(0, 0, bw, scr->height_in_pixels);
+        n -= left;
+        free(cmd);
+        clickq.head = (clickq.head + 1) % MAX_QUEUED_CLICKS;
+        clickq.count--;
+        clickq.written = 0;
     }
+}
 
-    if (!monhead)
-        exit(EXIT_FAILURE);
-
-    // For WM that support EWMH atoms
-    set_ewmh_atoms();
-
-    // Create the gc for drawing
-    gc[GC_DRAW] = xcb_generate_id(c);
-    xcb_create_gc(c, gc[GC_DRAW], monhead->pixmap, XCB_GC_FOREGROUND, (const uint32_t []){ fgc.v });
-
-    gc[GC_CLEAR] = xcb_generate_id(c);
-    xcb_create_gc(c, gc[GC_CLEAR], monhead->pixmap, XCB_GC_FOREGROUND, (const uint32_t []){ bgc.v });
-
-    gc[GC_ATTR] = xcb_generate_id(c);
-    xcb_create_gc(c, gc[GC_ATTR], monhead->pixmap, XCB_GC_FOREGROUND, (const uint32_t []){ ugc.v });
-
-    // Make the bar visible and clear the pixmap
+// Copy the regions of the pixmaps that changed onto the windows
+void
+frame_show (void)
+{
     for (monitor_t *mon = monhead; mon; mon = mon->next) {
-        fill_rect(mon->pixmap, gc[GC_CLEAR], 0, 0, mon->width, bh);
-        xcb_map_window(c, mon->window);
-
-        // Make sure that the window really gets in the place it's supposed to be
-        // Some WM such as Openbox need this
-        xcb_configure_window(c, mon->window, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y, (const uint32_t []){ mon->x, mon->y });
-
-        // Set the WM_NAME atom to the user specified value
-        if (wm_name)
-            xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 8 ,strlen(wm_name), wm_name);
+#if WITH_PRESENT
+        if (mon->buffer[1]) {
+            if (mon->damage_count)
+                present_frame(mon);
+            mon->damage_count = 0;
+            continue;
+        }
+#endif
+        monitor_blit(mon, mon->damage, mon->damage_count);
+        mon->damage_count = 0;
+    }
+}
 
-        // set the WM_CLASS atom instance to the executable name
-        if (wm_instance) {
-            char *wm_class;
-            int wm_class_offset, wm_class_len;
+#ifdef BENCH
+// The benchmarks draw every line of the corpus, nothing is collapsed
+bool
+bench_line (char *line)
+{
+    // The reader only keeps the line once this returns, draw it right away
+    if (input_line(line)) {
+        input.line = line - input.buf;
+        input.line_end = input.line + strlen(line) + 1;
+    }
+    parse();
+    frame_show();
+    xcb_flush(c);
 
-            // WM_CLASS is nullbyte seperated: wm_instance + "\0Bar\0"
-            wm_class_offset = strlen(wm_instance) + 1;
-            wm_class_len = wm_class_offset + 4;
+    return false;
+}
 
-            wm_class = calloc(1, wm_class_len + 1);
-            strcpy(wm_class, wm_instance);
-            strcpy(wm_class+wm_class_offset, "Bar");
+// Print what the run cost for bench/run.sh, the figures cover the whole lifetime of the bar
+void
+bench_report (void)
+{
+    struct rusage ru;
+    unsigned long long wchar = 0;
+    char line[64];
+    FILE *io;
 
-            xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 8, wm_class_len, wm_class);
+    const unsigned int requests = x_requests();
+    xcb_flush(c);
 
-            free(wm_class);
-        }
+    // Nothing else is written in a benchmark run, the bytes are those sent to the server
+    if ((io = fopen("/proc/self/io", "r"))) {
+        while (fgets(line, sizeof(line), io))
+            if (sscanf(line, "wchar: %llu", &wchar) == 1)
+                break;
+        fclose(io);
     }
 
-    char color[] = "#ffffff";
-    uint32_t nfgc = fgc.v & 0x00ffffff;
-    snprintf(color, sizeof(color), "#%06X", nfgc);
+    getrusage(RUSAGE_SELF, &ru);
 
-    if (!XftColorAllocName (dpy, visual_ptr, colormap, color, &sel_fg)) {
-        fprintf(stderr, "Couldn't allocate xft font color '%s'\n", color);
-    }
-    xcb_flush(c);
+    fprintf(stderr, "bench frames=%d requests=%u bytes=%llu cpu_us=%lld\n",
+            (int)stats.frames, requests, wchar,
+            (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
 }
+#endif
 
 void
 cleanup (void)
 {
     free(area_stack.area);
-    for (int i = 0; font_list[i]; i++) {
+    free(area_stack.str);
+    cp_map_free(&coverage_map);
+    free(frame.block);
+    free(frame.run);
+    free(frame.glyph);
+    free(last_frame.block);
+    free(last_frame.run);
+    free(last_frame.glyph);
+    for (int i = 0; i < font_count; i++) {
+#if WITH_SHM
+        for (int j = 0; j < font_list[i]->shm_glyphs; j++)
+            free(font_list[i]->shm_glyph[j].bits);
+        free(font_list[i]->shm_glyph);
+        cp_map_free(&font_list[i]->shm_map);
+#endif
         if (font_list[i]->xft_ft) {
+            cp_map_free(&font_list[i]->width_map);
             XftFontClose (dpy, font_list[i]->xft_ft);
         }
-        else {
+        else if (font_list[i]->pattern && font_list[i]->ptr) {
+            // Never needed, the server drops the font (if any) when the connection is closed
+            xcb_discard_reply(c, font_list[i]->query_cookie.sequence);
+        }
+        else if (font_list[i]->ptr) {
             xcb_close_font(c, font_list[i]->ptr);
             free(font_list[i]->width_lut);
         }
+        free(font_list[i]->pattern);
         free(font_list[i]);
     }
 
     while (monhead) {
         monitor_t *next = monhead->next;
-        xcb_destroy_window(c, monhead->window);
-        xcb_free_pixmap(c, monhead->pixmap);
-        free(monhead);
+        monitor_destroy(monhead);
         monhead = next;
     }
 
-    XftColorFree(dpy, visual_ptr, colormap, &sel_fg);
+    mirror_reset();
+    color_cache_flush();
+    free(color_cache);
+
+    if (sock_fd >= 0) {
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (client[i].fd >= 0)
+                client_close(&client[i]);
+        }
+        close(sock_fd);
+        // Not set if the socket couldn't be bound, the path belongs to somebody else then
+        if (sock_path)
+            unlink(sock_path);
+        free(sock_path);
+    }
+    for (int i = 0; i < regions; i++) {
+        free(region[i].name);
+        free(region[i].text);
+    }
+    while (clickq.count)
+        click_drop();
+    if (clickq.fd > STDOUT_FILENO)
+        close(clickq.fd);
+    for (int i = 0; i < sources; i++) {
+        if (source[i].fd >= 0)
+            close(source[i].fd);
+        free(source[i].name);
+        free(source[i].arg);
+    }
+    free(region);
+    free(line_piece);
+    free(piece);
 
     if (gc[GC_DRAW])
         xcb_free_gc(c, gc[GC_DRAW]);
@@ -1408,6 +4137,10 @@ cleanup (void)
         xcb_free_gc(c, gc[GC_CLEAR]);
     if (gc[GC_ATTR])
         xcb_free_gc(c, gc[GC_ATTR]);
+#ifdef BENCH
+    if (c)
+        bench_report();
+#endif
     if (c)
         xcb_disconnect(c);
 }
@@ -1432,23 +4165,34 @@ sighandle (int signal)
 {
     if (signal == SIGINT || signal == SIGTERM)
         exit(EXIT_SUCCESS);
+    // Dumped by the main loop, stdio isn't safe in here
+    if (signal == SIGUSR1)
+        stats_requested = 1;
 }
 
 
 int
 main (int argc, char **argv)
 {
-    struct pollfd pollin[2] = {
+    // The producers connected to the control socket come after these four, then the sources
+    struct pollfd pollin[4 + MAX_CLIENTS + MAX_SOURCES] = {
         { .fd = STDIN_FILENO, .events = POLLIN },
         { .fd = -1          , .events = POLLIN },
+        { .fd = -1          , .events = POLLIN },
+        { .fd = -1          , .events = POLLOUT },
     };
     xcb_generic_event_t *ev;
     xcb_expose_event_t *expose_ev;
     xcb_button_press_event_t *press_ev;
-    char input[4096] = {0, };
+    monitor_t *mon;
     bool permanent = false;
+    bool pending = false;
     int geom_v[4] = { -1, -1, 0, 0 };
-    int ch, areas;
+    int ch, areas, fps;
+    int64_t next_frame = 0;
+    int64_t next_stats = 0;
+    char *stats_path = NULL;
+    char *socket_path = NULL;
     char *wm_name;
     char *instance_name;
 
@@ -1456,15 +4200,20 @@ main (int argc, char **argv)
     atexit(cleanup);
     signal(SIGINT, sighandle);
     signal(SIGTERM, sighandle);
+    signal(SIGUSR1, sighandle);
+    // A consumer going away shows up as a failed write, the clicks are dropped then
+    signal(SIGPIPE, SIG_IGN);
 
     // B/W combo
-    dbgc = bgc = (rgba_t)0x00000000U;
+    dbgc = bgc = bgc_stop = (rgba_t)0x00000000U;
     dfgc = fgc = (rgba_t)0xffffffffU;
 
     dugc = ugc = fgc;
 
     // A safe default
     areas = 10;
+    // No cap on the redraw rate
+    fps = 0;
     wm_name = NULL;
 
     instance_name = strip_path(argv[0]);
@@ -1472,23 +4221,28 @@ main (int argc, char **argv)
     // Connect to the Xserver and initialize scr
     xconn();
 
-    while ((ch = getopt(argc, argv, "hg:bdf:a:pu:B:F:U:n:o:")) != -1) {
+    while ((ch = getopt(argc, argv, "hg:bdf:a:pu:B:F:U:n:o:r:S:s:t:q:")) != -1) {
         switch (ch) {
             case 'h':
                 printf ("lemonbar version %s patched with XFT support\n", VERSION);
-                printf ("usage: %s [-h | -g | -b | -d | -f | -a | -p | -n | -u | -B | -F]\n"
+                printf ("usage: %s [-h | -g | -b | -d | -f | -a | -p | -n | -u | -B | -F | -r | -S | -s | -t | -q]\n"
                         "\t-h Show this help\n"
                         "\t-g Set the bar geometry {width}x{height}+{xoffset}+{yoffset}\n"
                         "\t-b Put the bar at the bottom of the screen\n"
                         "\t-d Force docking (use this if your WM isn't EWMH compliant)\n"
                         "\t-f Set the font name to use\n"
-                        "\t-a Number of clickable areas available (default is 10)\n"
+                        "\t-a Number of clickable areas to preallocate (default is 10)\n"
                         "\t-p Don't close after the data ends\n"
                         "\t-n Set the WM_NAME atom to the specified value for this bar\n"
                         "\t-u Set the underline/overline height in pixels\n"
                         "\t-B Set background color in #AARRGGBB\n"
                         "\t-F Set foreground color in #AARRGGBB\n"
-                        "\t-o Add a vertical offset to the text, it can be negative\n", argv[0]);
+                        "\t-o Add a vertical offset to the text, it can be negative\n"
+                        "\t-r Set the maximum number of redraws per second\n"
+                        "\t-S Write the runtime statistics to this file every few seconds\n"
+                        "\t-s Read \"@name text\" lines from the producers connected to this socket\n"
+                        "\t-t Fill a region with a built-in source {region}={kind}:{interval}:{argument}\n"
+                        "\t-q Set what to do with the clicks when the output is stuck (drop or coalesce)\n", argv[0]);
                 exit (EXIT_SUCCESS);
             case 'g': (void)parse_geometry_string(optarg, geom_v); break;
             case 'p': permanent = true; break;
@@ -1498,10 +4252,20 @@ main (int argc, char **argv)
             case 'f': font_load(optarg); break;
             case 'u': bu = strtoul(optarg, NULL, 10); break;
             case 'o': add_y_offset(strtol(optarg, NULL, 10)); break;
-            case 'B': dbgc = bgc = parse_color(optarg, NULL, (rgba_t)0x00000000U); break;
+            case 'B': dbgc = bgc = bgc_stop = parse_color(optarg, NULL, (rgba_t)0x00000000U); break;
             case 'F': dfgc = fgc = parse_color(optarg, NULL, (rgba_t)0xffffffffU); break;
             case 'U': dugc = ugc = parse_color(optarg, NULL, fgc); break;
             case 'a': areas = strtoul(optarg, NULL, 10); break;
+            case 'r': fps = strtoul(optarg, NULL, 10); break;
+            case 'S': stats_path = optarg; break;
+            case 's': socket_path = optarg; break;
+            case 't': source_add(optarg); break;
+            case 'q':
+                if (!strcmp(optarg, "coalesce"))
+                    clickq.coalesce = true;
+                else if (strcmp(optarg, "drop"))
+                    fprintf(stderr, "Unknown overflow policy \"%s\", dropping the oldest clicks\n", optarg);
+                break;
         }
     }
 
@@ -1528,43 +4292,149 @@ main (int argc, char **argv)
 
     // Do the heavy lifting
     init(wm_name, instance_name);
-    // The string is strdup'd when the command line arguments are parsed
-    free(wm_name);
-    // The string is strdup'd when stripping argv[0]
-    free(instance_name);
     // Get the fd to Xserver
     pollin[1].fd = xcb_get_file_descriptor(c);
 
-    // Prevent fgets to block
+    if (socket_path) {
+        sock_open(socket_path);
+        pollin[2].fd = sock_fd;
+        // The producers keep the bar alive
+        permanent = true;
+    }
+
+    if (sources) {
+        for (int i = 0; i < sources; i++)
+            source_start(&source[i]);
+        // The sources keep the bar alive too
+        permanent = true;
+        pending = true;
+    }
+
+    // Prevent read to block
     fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
+    // ...and write too, the clicks are queued when the consumer is slow
+    click_open();
 	
     for (;;) {
         bool redraw = false;
+        bool relayout = false;
+        bool can_draw = true;
+        int timeout = -1;
 
         // If connection is in error state, then it has been shut down.
         if (xcb_connection_has_error(c))
             break;
 
-        if (poll(pollin, 2, -1) > 0) {
+#if WITH_SHM
+        // The buffers can't be touched until the server is done with them, the completion event
+        // wakes us up
+        can_draw = !shm_busy();
+#endif
+#if WITH_PRESENT
+        // Frames drawn faster than the screen refreshes would never be seen, they're collapsed
+        // like the lines coming faster than the frame rate
+        can_draw = can_draw && !present_busy();
+#endif
+
+        // Wake up in time to draw the pending line
+        if (pending && can_draw)
+            timeout = max(next_frame - now_ms(), 0);
+#if WITH_PRESENT
+        // ...or to stop waiting for the server
+        else if (pending && present_opcode)
+            timeout = PRESENT_TIMEOUT;
+#endif
+        // ...and to write the statistics
+        if (stats_path) {
+            const int wait = max(next_stats - now_ms(), 0);
+            timeout = (timeout < 0) ? wait : min(timeout, wait);
+        }
+
+        // Wait for the consumer only if there's something to tell it
+        pollin[3].fd = clickq.count ? clickq.fd : -1;
+        for (int i = 0; i < MAX_CLIENTS; i++)
+            pollin[4 + i] = (struct pollfd){ .fd = (sock_fd >= 0) ? client[i].fd : -1, .events = POLLIN };
+        for (int i = 0; i < sources; i++)
+            pollin[4 + MAX_CLIENTS + i] = (struct pollfd){ .fd = source[i].fd, .events = POLLIN };
+
+        if (poll(pollin, 4 + MAX_CLIENTS + sources, timeout) > 0) {
             if (pollin[0].revents & POLLHUP) {      // No more data...
                 if (permanent) pollin[0].fd = -1;   // ...null the fd and continue polling :D
                 else break;                         // ...bail out
             }
             if (pollin[0].revents & POLLIN) { // New input, process it
-                input[0] = '\0';
-                while (fgets(input, sizeof(input), stdin) != NULL)
-                    ; // Drain the buffer, the last line is actually used
-                parse(input);
-                redraw = true;
+                // Drain the pipe, the region updates are applied as they come and only the last
+                // line to draw is kept
+#ifdef BENCH
+                reader_fill(&input, STDIN_FILENO, bench_line);
+#else
+                if (reader_fill(&input, STDIN_FILENO, input_line))
+                    pending = true;
+#endif
+                if (input.eof) {
+                    if (permanent) pollin[0].fd = -1;
+                    else break;
+                }
+            }
+            for (int i = 0; i < MAX_CLIENTS && sock_fd >= 0; i++) {
+                if (!(pollin[4 + i].revents & (POLLIN | POLLHUP)))
+                    continue;
+                // Every line of a producer counts, they may be updating different regions
+                if (reader_fill(&client[i].reader, client[i].fd, client_line))
+                    pending = true;
+                if (client[i].reader.eof)
+                    client_close(&client[i]);
             }
+            for (int i = 0; i < sources; i++) {
+                uint64_t expired;
+
+                if (!(pollin[4 + MAX_CLIENTS + i].revents & POLLIN))
+                    continue;
+                // Missed expirations don't matter, only the current value is shown. A clock change
+                // (a suspend, NTP stepping the time) cancels the timer.
+                if (read(source[i].fd, &expired, sizeof(expired)) == sizeof(expired)) {
+                    source_run(&source[i]);
+                    pending = true;
+                } else if (errno == ECANCELED) {
+                    source_arm(&source[i]);
+                    source_run(&source[i]);
+                    pending = true;
+                }
+            }
+            if (pollin[3].revents & (POLLOUT | POLLERR)) // The consumer can take more clicks
+                click_flush();
+            if (pollin[2].revents & POLLIN) // A new producer
+                sock_accept();
             if (pollin[1].revents & POLLIN) { // The event comes from the Xorg server
                 while ((ev = xcb_poll_for_event(c))) {
                     expose_ev = (xcb_expose_event_t *)ev;
 
+                    // A burst of notifications comes for every change, handle them all at once
+                    if (randr_base &&
+                            ((ev->response_type & 0x7F) == randr_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY ||
+                             (ev->response_type & 0x7F) == randr_base + XCB_RANDR_NOTIFY))
+                        relayout = true;
+
+#if WITH_SHM
+                    if (shm_base && (ev->response_type & 0x7F) == shm_base + XCB_SHM_COMPLETION) {
+                        xcb_shm_completion_event_t *done_ev = (xcb_shm_completion_event_t *)ev;
+                        if ((mon = monitor_find_pixmap(done_ev->drawable)))
+                            mon->shm_busy = false;
+                    }
+#endif
+#if WITH_PRESENT
+                    if (present_opcode && (ev->response_type & 0x7F) == XCB_GE_GENERIC &&
+                            ((xcb_ge_generic_event_t *)ev)->extension == present_opcode)
+                        present_event((xcb_ge_generic_event_t *)ev);
+#endif
+
                     switch (ev->response_type & 0x7F) {
                         case XCB_EXPOSE:
-                            if (expose_ev->count == 0)
-                                redraw = true;
+                            // The pixmap is always up to date, just copy the exposed part
+                            if ((mon = monitor_find(expose_ev->window)))
+                                monitor_blit(mon, (const xcb_rectangle_t []){ {
+                                    expose_ev->x, expose_ev->y, expose_ev->width, expose_ev->height
+                                } }, 1);
                             break;
                         case XCB_BUTTON_PRESS:
                             press_ev = (xcb_button_press_event_t *)ev;
@@ -1572,8 +4442,8 @@ main (int argc, char **argv)
                                 area_t *area = area_get(press_ev->event, press_ev->detail, press_ev->event_x);
                                 // Respond to the click
                                 if (area) {
-                                    (void)write(STDOUT_FILENO, area->cmd, strlen(area->cmd));
-                                    (void)write(STDOUT_FILENO, "\n", 1);
+                                    stats.clicks++;
+                                    click_push(area_stack.str + area->cmd);
                                 }
                             }
                         break;
@@ -1581,17 +4451,50 @@ main (int argc, char **argv)
 
                     free(ev);
                 }
+
+                // All the clicks of the burst go out together
+                if (clickq.count)
+                    click_flush();
             }
         }
 
-        if (redraw) { // Copy our temporary pixmap onto the window
-            for (monitor_t *mon = monhead; mon; mon = mon->next) {
-                xcb_copy_area(c, mon->pixmap, mon->window, gc[GC_DRAW], 0, 0, 0, 0, mon->width, bh);
-            }
+        if (relayout) {
+            monitor_update(wm_name, instance_name);
+            // Draw the last line again on the new layout
+            if (input.line >= 0)
+                pending = true;
+        }
+
+        // Lines received faster than the frame rate are collapsed, only the newest one is drawn
+        if (pending && now_ms() >= next_frame && can_draw) {
+            parse();
+            pending = false;
+            redraw = true;
+            if (fps > 0)
+                next_frame = now_ms() + 1000 / fps;
+        }
+
+        if (stats_requested) {
+            stats_requested = 0;
+            stats_dump(stderr);
         }
 
+        if (stats_path && now_ms() >= next_stats) {
+            stats_write(stats_path);
+            next_stats = now_ms() + STATS_INTERVAL;
+        }
+
+        if (redraw)
+            frame_show();
+
         xcb_flush(c);
     }
 
+    free(input.buf);
+    // The string is strdup'd when the command line arguments are parsed
+    free(wm_name);
+    // The string is strdup'd when stripping argv[0]
+    free(instance_name);
+
     return EXIT_SUCCESS;
 }